@@ -0,0 +1,419 @@
+/* Benchmark of the CTC beam search decoder
+ *
+ * Decodes synthetic peaky CTC outputs, or outputs recorded in a .npy file,
+ * for every combination of the given vocabulary sizes, beam sizes, cutoff_top_n
+ * values and language models, and prints one JSON object per combination:
+ *
+ *     {"input": "synthetic", "vocab_size": 30, "beam_size": 64,
+ *      "cutoff_top_n": 40, "lm": "none", "lm_type": "none", ...,
+ *      "frames_per_sec": ..., "batch_frames_per_sec": ...,
+ *      "stages_ms": {"scorer_setup": ..., "search": ..., "finalize": ...},
+ *      "peak_rss_kb": ...}
+ *
+ * "search" and "finalize" are the serial time of DecoderState::next() and
+ * DecoderState::finalize() over the batch, frames_per_sec the frames they
+ * decode per second. batch_frames_per_sec is the throughput of
+ * ctc_beam_search_decoder_batch() with --threads threads. The best of
+ * --repeats runs is reported. peak_rss_kb is the peak resident memory of the
+ * process so far, so sweeps are best run from the smallest configuration.
+ *
+ * Language models are word or character based depending on their
+ * vocabulary, both are given with --lm. They need --labels, the labels of
+ * the model outputs in the format of CTCBeamDecoder, one per line, blank
+ * first.
+ *
+ * Build with benchmarks/build.py, then run e.g.
+ *     benchmarks/benchmark --vocab-sizes 30,1000 --beam-sizes 16,128
+ *     benchmarks/benchmark --logits out.npy --labels labels.txt \
+ *         --tokenization-labels u0020 --lm words.binary --lm chars.binary
+ */
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ctc_beam_search_decoder.h"
+#include "decoder_utils.h"
+#include "scorer.h"
+
+namespace {
+
+struct Options {
+  std::vector<size_t> vocab_sizes = {30, 1000, 5000};
+  std::vector<size_t> beam_sizes = {16, 64, 256};
+  std::vector<size_t> cutoff_top_ns = {10, 40};
+  double cutoff_prob = 1.0;
+  std::vector<std::string> lm_paths;
+  std::string labels_path;
+  std::vector<std::string> tokenization_labels;
+  double alpha = 0.5;
+  double beta = 1.0;
+  std::string logits_path;
+  bool log_probs = false;
+  size_t num_frames = 500;
+  size_t batch_size = 8;
+  size_t num_threads = 4;
+  size_t repeats = 3;
+  unsigned seed = 1;
+};
+
+// outputs of a batch of utterances over a vocabulary
+struct Batch {
+  size_t vocab_size;
+  std::vector<std::vector<float>> buffers;
+  std::vector<ProbsView> views;
+
+  size_t num_frames() const {
+    size_t n = 0;
+    for (const auto &view : views) {
+      n += view.num_time_steps;
+    }
+    return n;
+  }
+};
+
+void usage(const char *program) {
+  std::cerr
+      << "usage: " << program << " [options]\n"
+      << "  --vocab-sizes N,...         synthetic vocabulary sizes (30,1000,5000)\n"
+      << "  --beam-sizes N,...          beam sizes (16,64,256)\n"
+      << "  --cutoff-top-n N,...        cutoff_top_n values (10,40)\n"
+      << "  --cutoff-prob P             cutoff_prob (1.0)\n"
+      << "  --lm PATH                   language model, may be repeated\n"
+      << "  --labels PATH               labels, one per line, blank first\n"
+      << "  --tokenization-labels L,... tokenization labels of the lms\n"
+      << "  --alpha A --beta B          lm weights (0.5, 1.0)\n"
+      << "  --logits PATH               recorded outputs, float .npy of shape\n"
+      << "                              (time, vocab) or (batch, time, vocab)\n"
+      << "  --log-probs                 inputs are log probabilities\n"
+      << "  --frames N                  frames per synthetic utterance (500)\n"
+      << "  --batch N                   synthetic utterances (8)\n"
+      << "  --threads N                 threads of the batch decoder (4)\n"
+      << "  --repeats N                 runs per configuration (3)\n"
+      << "  --seed N                    seed of the synthetic outputs (1)\n";
+  std::exit(2);
+}
+
+std::vector<size_t> parse_sizes(const std::string &arg) {
+  std::vector<size_t> sizes;
+  for (const auto &field : split_str(arg, ",")) {
+    sizes.push_back(std::stoul(field));
+  }
+  return sizes;
+}
+
+Options parse_options(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        usage(argv[0]);
+      }
+      return argv[++i];
+    };
+    if (arg == "--vocab-sizes") {
+      options.vocab_sizes = parse_sizes(value());
+    } else if (arg == "--beam-sizes") {
+      options.beam_sizes = parse_sizes(value());
+    } else if (arg == "--cutoff-top-n") {
+      options.cutoff_top_ns = parse_sizes(value());
+    } else if (arg == "--cutoff-prob") {
+      options.cutoff_prob = std::stod(value());
+    } else if (arg == "--lm") {
+      options.lm_paths.push_back(value());
+    } else if (arg == "--labels") {
+      options.labels_path = value();
+    } else if (arg == "--tokenization-labels") {
+      options.tokenization_labels = split_str(value(), ",");
+    } else if (arg == "--alpha") {
+      options.alpha = std::stod(value());
+    } else if (arg == "--beta") {
+      options.beta = std::stod(value());
+    } else if (arg == "--logits") {
+      options.logits_path = value();
+    } else if (arg == "--log-probs") {
+      options.log_probs = true;
+    } else if (arg == "--frames") {
+      options.num_frames = std::stoul(value());
+    } else if (arg == "--batch") {
+      options.batch_size = std::stoul(value());
+    } else if (arg == "--threads") {
+      options.num_threads = std::stoul(value());
+    } else if (arg == "--repeats") {
+      options.repeats = std::max<size_t>(1, std::stoul(value()));
+    } else if (arg == "--seed") {
+      options.seed = std::stoul(value());
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (!options.lm_paths.empty() && options.labels_path.empty()) {
+    std::cerr << "--lm needs --labels" << std::endl;
+    std::exit(2);
+  }
+  return options;
+}
+
+std::vector<std::string> read_labels(const std::string &path) {
+  std::ifstream strm(path);
+  VALID_CHECK(static_cast<bool>(strm), "Cannot open the labels");
+  std::vector<std::string> labels;
+  std::string line;
+  while (std::getline(strm, line)) {
+    if (!line.empty()) {
+      labels.push_back(line);
+    }
+  }
+  return labels;
+}
+
+// labels of a synthetic vocabulary, in the uxxxx format of CTCBeamDecoder
+std::vector<std::string> synthetic_labels(size_t vocab_size) {
+  std::vector<std::string> labels;
+  for (size_t i = 0; i < vocab_size; ++i) {
+    char label[16];
+    snprintf(label, sizeof(label), "u%04zx", i == 0 ? 0x5f : 0x60 + i);
+    labels.push_back(label);
+  }
+  return labels;
+}
+
+// Softmax outputs of a CTC model: most frames are blank, the others peak on
+// one label, with the usual smear over the rest of the vocabulary.
+Batch synthetic_batch(const Options &options, size_t vocab_size) {
+  std::mt19937 gen(options.seed);
+  std::normal_distribution<float> noise(0.0, 1.0);
+  std::uniform_real_distribution<float> uniform(0.0, 1.0);
+  std::uniform_int_distribution<size_t> label(1, vocab_size - 1);
+
+  Batch batch;
+  batch.vocab_size = vocab_size;
+  batch.buffers.resize(options.batch_size);
+  for (size_t b = 0; b < options.batch_size; ++b) {
+    // utterances of various lengths, as in a real batch
+    size_t num_frames = options.num_frames / 2 + gen() % (options.num_frames + 1);
+    std::vector<float> &buffer = batch.buffers[b];
+    buffer.resize(num_frames * vocab_size);
+    for (size_t t = 0; t < num_frames; ++t) {
+      float *row = &buffer[t * vocab_size];
+      for (size_t c = 0; c < vocab_size; ++c) {
+        row[c] = noise(gen);
+      }
+      row[uniform(gen) < 0.7 ? 0 : label(gen)] += 8.0 + noise(gen);
+      // a runner up, to give the beam some alternatives
+      row[label(gen)] += 4.0 * uniform(gen);
+
+      float max_logit = *std::max_element(row, row + vocab_size);
+      double sum = 0.0;
+      for (size_t c = 0; c < vocab_size; ++c) {
+        sum += std::exp(row[c] - max_logit);
+      }
+      float log_sum = max_logit + std::log(sum);
+      for (size_t c = 0; c < vocab_size; ++c) {
+        row[c] = options.log_probs ? row[c] - log_sum : std::exp(row[c] - log_sum);
+      }
+    }
+  }
+  for (size_t b = 0; b < options.batch_size; ++b) {
+    batch.views.emplace_back(batch.buffers[b].data(),
+                             batch.buffers[b].size() / vocab_size,
+                             vocab_size, vocab_size, 1);
+  }
+  return batch;
+}
+
+// Read a little endian float32 or float64 array in C order from a .npy file
+Batch npy_batch(const std::string &path) {
+  std::ifstream strm(path, std::ios_base::in | std::ios_base::binary);
+  VALID_CHECK(static_cast<bool>(strm), "Cannot open the logits");
+  char magic[8];
+  strm.read(magic, sizeof(magic));
+  VALID_CHECK(strm && std::memcmp(magic, "\x93NUMPY", 6) == 0, "Not a .npy file");
+  uint32_t header_size = 0;
+  if (magic[6] == 1) {
+    uint16_t size16;
+    strm.read(reinterpret_cast<char *>(&size16), sizeof(size16));
+    header_size = size16;
+  } else {
+    strm.read(reinterpret_cast<char *>(&header_size), sizeof(header_size));
+  }
+  std::string header(header_size, ' ');
+  strm.read(&header[0], header_size);
+  VALID_CHECK(static_cast<bool>(strm), "Truncated .npy header");
+
+  bool is_double = header.find("'<f8'") != std::string::npos;
+  VALID_CHECK(is_double || header.find("'<f4'") != std::string::npos,
+              "The logits must be little endian float32 or float64");
+  VALID_CHECK(header.find("'fortran_order': False") != std::string::npos,
+              "The logits must be in C order");
+  size_t open = header.find('(', header.find("'shape'"));
+  size_t close = header.find(')', open);
+  std::vector<size_t> shape;
+  for (const auto &dim : split_str(header.substr(open + 1, close - open - 1), ",")) {
+    if (dim.find_first_not_of(' ') != std::string::npos) {
+      shape.push_back(std::stoul(dim));
+    }
+  }
+  VALID_CHECK(shape.size() == 2 || shape.size() == 3,
+              "The logits must be of shape (time, vocab) or (batch, time, vocab)");
+  if (shape.size() == 2) {
+    shape.insert(shape.begin(), 1);
+  }
+
+  Batch batch;
+  batch.vocab_size = shape[2];
+  size_t utterance_size = shape[1] * shape[2];
+  for (size_t b = 0; b < shape[0]; ++b) {
+    std::vector<float> buffer(utterance_size);
+    if (is_double) {
+      std::vector<double> values(utterance_size);
+      strm.read(reinterpret_cast<char *>(values.data()), utterance_size * sizeof(double));
+      std::copy(values.begin(), values.end(), buffer.begin());
+    } else {
+      strm.read(reinterpret_cast<char *>(buffer.data()), utterance_size * sizeof(float));
+    }
+    VALID_CHECK(static_cast<bool>(strm), "Truncated .npy data");
+    batch.buffers.push_back(std::move(buffer));
+  }
+  for (const auto &buffer : batch.buffers) {
+    batch.views.emplace_back(buffer.data(), shape[1], shape[2], shape[2], 1);
+  }
+  return batch;
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+long peak_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+std::string json_string(const std::string &str) {
+  std::string quoted = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+    }
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+void run(const Options &options,
+         const Batch &batch,
+         const std::string &input,
+         const std::vector<std::string> &labels,
+         const std::string &lm_path,
+         Scorer *scorer,
+         double scorer_setup_ms) {
+  size_t num_frames = batch.num_frames();
+  for (size_t beam_size : options.beam_sizes) {
+    for (size_t cutoff_top_n : options.cutoff_top_ns) {
+      double search_ms = 0.0, finalize_ms = 0.0, batch_ms = 0.0;
+      for (size_t r = 0; r < options.repeats; ++r) {
+        double run_search_ms = 0.0, run_finalize_ms = 0.0;
+        for (const auto &view : batch.views) {
+          DecoderState state(labels, beam_size, options.cutoff_prob, cutoff_top_n,
+                             0, scorer, options.log_probs);
+          auto start = std::chrono::steady_clock::now();
+          state.next(view);
+          run_search_ms += elapsed_ms(start);
+          start = std::chrono::steady_clock::now();
+          state.finalize();
+          run_finalize_ms += elapsed_ms(start);
+        }
+        auto start = std::chrono::steady_clock::now();
+        ctc_beam_search_decoder_batch(batch.views, labels, beam_size,
+                                      options.num_threads, options.cutoff_prob,
+                                      cutoff_top_n, 0, scorer, options.log_probs);
+        double run_batch_ms = elapsed_ms(start);
+
+        if (r == 0 || run_search_ms + run_finalize_ms < search_ms + finalize_ms) {
+          search_ms = run_search_ms;
+          finalize_ms = run_finalize_ms;
+        }
+        batch_ms = r == 0 ? run_batch_ms : std::min(batch_ms, run_batch_ms);
+      }
+
+      std::string lm_type = scorer == nullptr ? "none"
+                            : scorer->is_character_based() ? "char" : "word";
+      printf("{\"input\": %s, \"vocab_size\": %zu, \"beam_size\": %zu, "
+             "\"cutoff_top_n\": %zu, \"cutoff_prob\": %g, \"lm\": %s, "
+             "\"lm_type\": \"%s\", \"utterances\": %zu, \"frames\": %zu, "
+             "\"threads\": %zu, \"frames_per_sec\": %.1f, "
+             "\"batch_frames_per_sec\": %.1f, \"stages_ms\": {\"scorer_setup\": "
+             "%.3f, \"search\": %.3f, \"finalize\": %.3f, \"batch\": %.3f}, "
+             "\"peak_rss_kb\": %ld}\n",
+             json_string(input).c_str(), batch.vocab_size, beam_size,
+             cutoff_top_n, options.cutoff_prob, json_string(lm_path).c_str(),
+             lm_type.c_str(), batch.views.size(), num_frames,
+             options.num_threads, num_frames / ((search_ms + finalize_ms) / 1000.0),
+             num_frames / (batch_ms / 1000.0), scorer_setup_ms, search_ms,
+             finalize_ms, batch_ms, peak_rss_kb());
+      fflush(stdout);
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options = parse_options(argc, argv);
+
+  std::vector<std::string> labels;
+  if (!options.labels_path.empty()) {
+    labels = read_labels(options.labels_path);
+  }
+
+  std::vector<Batch> batches;
+  std::string input;
+  if (!options.logits_path.empty()) {
+    input = options.logits_path;
+    batches.push_back(npy_batch(options.logits_path));
+  } else if (!labels.empty()) {
+    input = "synthetic";
+    batches.push_back(synthetic_batch(options, labels.size()));
+  } else {
+    input = "synthetic";
+    for (size_t vocab_size : options.vocab_sizes) {
+      VALID_CHECK_GT(vocab_size, 1, "The vocabulary needs a label and the blank");
+      batches.push_back(synthetic_batch(options, vocab_size));
+    }
+  }
+
+  for (const auto &batch : batches) {
+    std::vector<std::string> batch_labels =
+        labels.empty() ? synthetic_labels(batch.vocab_size) : labels;
+    VALID_CHECK_EQ(batch_labels.size(), batch.vocab_size,
+                   "The labels do not match the vocabulary of the logits");
+    run(options, batch, input, batch_labels, "none", nullptr, 0.0);
+
+    for (const auto &lm_path : options.lm_paths) {
+      auto start = std::chrono::steady_clock::now();
+      Scorer scorer(options.alpha, options.beta, lm_path, batch_labels,
+                    options.tokenization_labels);
+      double scorer_setup_ms = elapsed_ms(start);
+      run(options, batch, input, batch_labels, lm_path, &scorer, scorer_setup_ms);
+    }
+  }
+  return 0;
+}
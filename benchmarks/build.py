@@ -0,0 +1,98 @@
+#!/usr/bin/env python
+"""Build benchmarks/benchmark, the C++ benchmark of the decoder.
+
+It is compiled with the flags and the third party libraries of the extension, so run `python build.py` (or
+`pip install .`) once first to fetch them. Objects are kept in benchmarks/build and only rebuilt when their
+source changes, remove it after changing a header.
+
+    python benchmarks/build.py [-j JOBS]
+    benchmarks/benchmark --help
+"""
+
+import argparse
+import glob
+import multiprocessing
+import os
+import subprocess
+import sys
+
+ROOT = os.path.realpath(os.path.join(os.path.dirname(__file__), '..'))
+BUILD_DIR = os.path.join(ROOT, 'benchmarks', 'build')
+
+
+# Does gcc compile with this header and library?
+def compile_test(header, library):
+    dummy_path = os.path.join(BUILD_DIR, "dummy")
+    command = "bash -c \"g++ -include " + header + " -l" + library + " -x c++ - <<<'int main() {}' -o " + dummy_path \
+              + " >/dev/null 2>/dev/null && rm " + dummy_path + " 2>/dev/null\""
+    return os.system(command) == 0
+
+
+def compile_object(args):
+    source, obj, command = args
+    if os.path.exists(obj) and os.path.getmtime(obj) >= os.path.getmtime(source):
+        return 0
+    print('compiling ' + os.path.relpath(source, ROOT))
+    sys.stdout.flush()
+    return subprocess.call(command)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-j', '--jobs', type=int, default=multiprocessing.cpu_count())
+    args = parser.parse_args()
+
+    if not os.path.isdir(BUILD_DIR):
+        os.makedirs(BUILD_DIR)
+
+    # same as the extension, see build.py
+    compile_args = ['-O3', '-DNDEBUG', '-DKENLM_MAX_ORDER=6', '-std=c++11', '-w']
+    libs = ['-lpthread']
+    for header, library, define in [('zlib.h', 'z', 'HAVE_ZLIB'), ('bzlib.h', 'bz2', 'HAVE_BZLIB'),
+                                    ('lzma.h', 'lzma', 'HAVE_XZLIB')]:
+        if compile_test(header, library):
+            compile_args.append('-D' + define)
+            libs.append('-l' + library)
+    compile_args.extend(['-DINCLUDE_KENLM', '-DKENLM_MAX_ORDER=6'])
+    if os.environ.get('CTCDECODE_FAST_LOG_SUM_EXP') == '1':
+        compile_args.append('-DCTC_FAST_LOG_SUM_EXP')
+
+    third_party_libs = ["kenlm", "openfst-1.6.7/src/include", "ThreadPool", "boost_1_63_0", "utf8"]
+    includes = ['-I' + os.path.join(ROOT, 'third_party', lib) for lib in third_party_libs]
+    includes.append('-I' + os.path.join(ROOT, 'ctcdecode', 'src'))
+    for lib in ['kenlm/lm', 'openfst-1.6.7/src/include']:
+        if not os.path.isdir(os.path.join(ROOT, 'third_party', lib)):
+            sys.exit('third_party/{} is missing, run `python build.py` first'.format(lib))
+
+    lib_sources = glob.glob(os.path.join(ROOT, 'third_party/kenlm/util/*.cc')) + \
+        glob.glob(os.path.join(ROOT, 'third_party/kenlm/lm/*.cc')) + \
+        glob.glob(os.path.join(ROOT, 'third_party/kenlm/util/double-conversion/*.cc')) + \
+        glob.glob(os.path.join(ROOT, 'third_party/openfst-1.6.7/src/lib/*.cc'))
+    lib_sources = [fn for fn in lib_sources if not (fn.endswith('main.cc') or fn.endswith('test.cc'))]
+    # the binding needs torch, the benchmark calls the decoder directly
+    ctc_sources = [fn for fn in glob.glob(os.path.join(ROOT, 'ctcdecode/src/*.cpp'))
+                   if not fn.endswith('binding.cpp')]
+    sources = [os.path.join(ROOT, 'benchmarks', 'benchmark.cpp')] + ctc_sources + lib_sources
+
+    jobs = []
+    objects = []
+    for source in sources:
+        name = os.path.relpath(source, ROOT).replace(os.sep, '_')
+        obj = os.path.join(BUILD_DIR, os.path.splitext(name)[0] + '.o')
+        objects.append(obj)
+        jobs.append((source, obj, ['g++', '-c', source, '-o', obj] + compile_args + includes))
+
+    pool = multiprocessing.Pool(max(args.jobs, 1))
+    failed = [source for (source, _, _), status in zip(jobs, pool.map(compile_object, jobs)) if status != 0]
+    pool.close()
+    if failed:
+        sys.exit('failed to compile ' + ', '.join(failed))
+
+    binary = os.path.join(ROOT, 'benchmarks', 'benchmark')
+    if subprocess.call(['g++', '-o', binary] + objects + libs) != 0:
+        sys.exit('failed to link ' + binary)
+    print('built ' + os.path.relpath(binary, ROOT))
+
+
+if __name__ == '__main__':
+    main()
@@ -57,6 +57,10 @@ if compile_test('lzma.h', 'lzma'):
 
 third_party_libs = ["kenlm", "openfst-1.6.7/src/include", "ThreadPool", "boost_1_63_0", "utf8"]
 compile_args.extend(['-DINCLUDE_KENLM', '-DKENLM_MAX_ORDER=6'])
+# CTCDECODE_FAST_LOG_SUM_EXP=1 builds the decoder with the table based log_sum_exp, within 1e-5 of the exact one,
+# see decoder_utils.h
+if os.environ.get('CTCDECODE_FAST_LOG_SUM_EXP') == '1':
+    compile_args.append('-DCTC_FAST_LOG_SUM_EXP')
 lib_sources = glob.glob('third_party/kenlm/util/*.cc') + glob.glob('third_party/kenlm/lm/*.cc') + glob.glob(
     'third_party/kenlm/util/double-conversion/*.cc') + glob.glob('third_party/openfst-1.6.7/src/lib/*.cc')
 lib_sources = [fn for fn in lib_sources if not (fn.endswith('main.cc') or fn.endswith('test.cc'))]
@@ -1,10 +1,23 @@
 from ._ext import ctc_decode
 import torch
 
+# KenLM load methods of the language model, in the order of util::LoadMethod. Binary models are memory mapped
+# shared by 'lazy' and 'populate_*', so that the processes decoding with one model share its pages; 'lazy'
+# doesn't read the whole file at startup. 'read' and 'parallel_read' copy it into each process.
+LM_LOAD_METHODS = ('lazy', 'populate_or_lazy', 'populate_or_read', 'read', 'parallel_read')
+
+# performance counters returned by decode(..., return_stats=True), in the order of DecoderStats::to_vector(). Times
+# are in milliseconds; lm_ms is summed over the expansion threads and is part of expansion_ms.
+DECODER_STATS_FIELDS = ('num_frames', 'num_skipped_frames', 'num_degraded_frames', 'num_candidates', 'num_trie_hits', 'num_trie_new_nodes',
+                        'num_dictionary_rejections', 'num_lm_requests', 'num_lm_queries', 'num_lm_cache_hits',
+                        'peak_live_nodes', 'pruning_ms', 'expansion_ms', 'lm_ms', 'selection_ms', 'finalize_ms')
+
 
 class CTCBeamDecoder(object):
     def __init__(self, labels, tokenization_labels=None, model_path=None, alpha=0, beta=0, cutoff_top_n=40, cutoff_prob=1.0, beam_width=100,
-                 num_processes=4, blank_id=0):
+                 num_processes=4, blank_id=0, lm_cache_size=0, log_probs_input=False,
+                 blank_skip_threshold=1.0, num_expansion_threads=0, dictionary_cache_dir=None,
+                 lm_load_method='lazy', beam_threshold=0, min_beam_width=0, min_cutoff_top_n=0):
         self.cutoff_top_n = cutoff_top_n
         self._beam_width = beam_width
         self._scorer = None
@@ -14,13 +27,48 @@ class CTCBeamDecoder(object):
         self._labels = ','.join(labels).encode('ascii')
         self._num_labels = len(labels)
         self._blank_id = blank_id
+        if lm_load_method not in LM_LOAD_METHODS:
+            raise ValueError("lm_load_method must be one of {}".format(', '.join(LM_LOAD_METHODS)))
+        if min_beam_width > beam_width:
+            raise ValueError("min_beam_width must not be greater than beam_width")
+        if min_cutoff_top_n > cutoff_top_n:
+            raise ValueError("min_cutoff_top_n must not be greater than cutoff_top_n")
         if model_path and tokenization_labels:
             self._tokenization_labels = ','.join(tokenization_labels).encode('ascii')
-            self._scorer = ctc_decode.paddle_get_scorer(alpha, beta, model_path.encode(), self._labels, self._tokenization_labels, self._num_labels)
+            # the dictionary built from the lm vocabulary is cached in dictionary_cache_dir, if given
+            self._scorer = ctc_decode.paddle_get_scorer_with_options(alpha, beta, model_path.encode(), self._labels,
+                                                                     self._tokenization_labels, self._num_labels,
+                                                                     (dictionary_cache_dir or '').encode(),
+                                                                     LM_LOAD_METHODS.index(lm_load_method))
+            # scores cache shared by all the decoding threads, 0 disables it
+            ctc_decode.set_cache_capacity(self._scorer, lm_cache_size)
         self._cutoff_prob = cutoff_prob
+        # probs passed to decode are log probabilities, e.g. the output of log_softmax
+        self._log_probs_input = int(bool(log_probs_input))
+        # frames whose blank probability reaches it are not expanded, 1.0 disables it
+        self._blank_skip_threshold = blank_skip_threshold
+        # expansions and prefixes scoring more than this log margin below the best one are dropped, 0 disables it
+        self._beam_threshold = beam_threshold
+        # the beam width and the number of candidates of each frame grow with its entropy, from these minimums for
+        # a confident frame up to beam_width and every label (cutoff_top_n if cutoff_prob < 1.0), 0 disables it.
+        # The entropy of the acoustic model doesn't account for the language model, keep the minimums close to the
+        # maximums when decoding with one
+        self._min_beam_width = min_beam_width
+        self._min_cutoff_top_n = min_cutoff_top_n
+        # parsed labels, parameters and worker threads, reused by every call. num_expansion_threads extra
+        # threads split the lm scoring of the beam expansion of each utterance, for low latency decoding with
+        # wide beams and a language model; without one they are not started
+        self._decoder = ctc_decode.paddle_get_decoder(self._labels, self._num_labels, self._beam_width,
+                                                      self._num_processes, self._cutoff_prob, self.cutoff_top_n,
+                                                      self._blank_id, self._log_probs_input,
+                                                      self._blank_skip_threshold, self._beam_threshold,
+                                                      self._min_beam_width, self._min_cutoff_top_n,
+                                                      num_expansion_threads, self._scorer)
 
-    def decode(self, probs, seq_lens=None):
+    def decode(self, probs, seq_lens=None, return_stats=False, time_budget_ms=0, utterance_time_budget_ms=0):
         # We expect batch x seq x label_size
+        # with a time budget for the whole call, or for each sample from its start, the beam of the samples which
+        # would overrun it is narrowed, down to the best path. Whether each sample was is returned last, as degraded
         probs = probs.cpu().float()
         batch_size, max_seq_len = probs.size(0), probs.size(1)
         if seq_lens is None:
@@ -31,14 +79,98 @@ class CTCBeamDecoder(object):
         timesteps = torch.IntTensor(batch_size, self._beam_width, max_seq_len).cpu().int()
         scores = torch.FloatTensor(batch_size, self._beam_width).cpu().float()
         out_seq_len = torch.IntTensor(batch_size, self._beam_width).cpu().int()
-        if self._scorer:
-            ctc_decode.paddle_beam_decode_lm(probs, seq_lens, self._labels, self._num_labels, self._beam_width,
-                                             self._num_processes, self._cutoff_prob, self.cutoff_top_n, self._blank_id,
-                                             self._scorer, output, timesteps, scores, out_seq_len)
+        # counting and timing the decoding has a small cost, only done when asked for
+        stats = torch.DoubleTensor() if return_stats else None
+        has_deadline = time_budget_ms > 0 or utterance_time_budget_ms > 0
+        degraded = torch.IntTensor() if has_deadline else None
+        ctc_decode.paddle_beam_decode_with_decoder(self._decoder, probs, seq_lens, output, timesteps, scores,
+                                                   out_seq_len, time_budget_ms, utterance_time_budget_ms, stats,
+                                                   degraded)
+
+        results = (output, scores, timesteps, out_seq_len)
+        if return_stats:
+            # one dict of DECODER_STATS_FIELDS per sample
+            results += ([dict(zip(DECODER_STATS_FIELDS, row)) for row in stats.tolist()],)
+        if has_deadline:
+            results += ([bool(flag) for flag in degraded.tolist()],)
+        return results
+
+    def decode_ragged(self, probs, seq_lens=None, num_results=1, return_stats=False, time_budget_ms=0,
+                      utterance_time_budget_ms=0):
+        """Decode like decode(), returning only the num_results best paths of each sample, concatenated.
+
+        Path p of sample b is tokens[offsets[b * num_results + p]:offsets[b * num_results + p + 1]], with its
+        timesteps at the same positions of timesteps, and its score at scores[b][p]. The output memory scales with
+        the length of the paths rather than with beam_width x max_seq_len; samples with fewer paths than
+        num_results get empty ones with an infinite score.
+        """
+        if num_results < 1:
+            raise ValueError("num_results must be positive")
+        probs = probs.cpu().float()
+        batch_size, max_seq_len = probs.size(0), probs.size(1)
+        if seq_lens is None:
+            seq_lens = torch.IntTensor(batch_size).fill_(max_seq_len)
         else:
-            ctc_decode.paddle_beam_decode(probs, seq_lens, self._labels, self._num_labels, self._beam_width, self._num_processes,
-                                          self._cutoff_prob, self.cutoff_top_n, self._blank_id, output, timesteps,
-                                          scores, out_seq_len)
+            seq_lens = seq_lens.cpu().int()
+        # resized by the decoder
+        tokens = torch.IntTensor()
+        timesteps = torch.IntTensor()
+        offsets = torch.IntTensor()
+        scores = torch.FloatTensor()
+        stats = torch.DoubleTensor() if return_stats else None
+        has_deadline = time_budget_ms > 0 or utterance_time_budget_ms > 0
+        degraded = torch.IntTensor() if has_deadline else None
+        ctc_decode.paddle_beam_decode_ragged_with_decoder(self._decoder, probs, seq_lens, num_results, tokens,
+                                                          timesteps, offsets, scores, time_budget_ms,
+                                                          utterance_time_budget_ms, stats, degraded)
+
+        results = (tokens, timesteps, offsets, scores)
+        if return_stats:
+            results += ([dict(zip(DECODER_STATS_FIELDS, row)) for row in stats.tolist()],)
+        if has_deadline:
+            results += ([bool(flag) for flag in degraded.tolist()],)
+        return results
+
+    def decode_greedy(self, probs, seq_lens=None):
+        """Best path decoding, without beam search nor language model, as a ragged output of one path per sample.
+
+        The path of sample b is tokens[offsets[b]:offsets[b + 1]], scores[b][0] its negative log probability.
+        """
+        probs = probs.cpu().float()
+        batch_size, max_seq_len = probs.size(0), probs.size(1)
+        if seq_lens is None:
+            seq_lens = torch.IntTensor(batch_size).fill_(max_seq_len)
+        else:
+            seq_lens = seq_lens.cpu().int()
+        tokens = torch.IntTensor()
+        timesteps = torch.IntTensor()
+        offsets = torch.IntTensor()
+        scores = torch.FloatTensor()
+        ctc_decode.paddle_greedy_decode_with_decoder(self._decoder, probs, seq_lens, tokens, timesteps, offsets,
+                                                     scores)
+
+        return tokens, timesteps, offsets, scores
+
+    def decode_online(self, probs, states, is_eos_s, seq_lens=None):
+        # We expect batch x seq x label_size, holding the next chunk of each stream
+        probs = probs.cpu().float()
+        batch_size, max_seq_len = probs.size(0), probs.size(1)
+        if seq_lens is None:
+            seq_lens = torch.IntTensor(batch_size).fill_(max_seq_len)
+        else:
+            seq_lens = seq_lens.cpu().int()
+        for state, seq_len in zip(states, seq_lens):
+            state.num_frames += min(int(seq_len), max_seq_len)
+        # partial results cover every frame fed so far, not only this chunk
+        max_num_frames = max([state.num_frames for state in states] + [1])
+        output = torch.IntTensor(batch_size, self._beam_width, max_num_frames).cpu().int()
+        timesteps = torch.IntTensor(batch_size, self._beam_width, max_num_frames).cpu().int()
+        scores = torch.FloatTensor(batch_size, self._beam_width).cpu().float()
+        out_seq_len = torch.IntTensor(batch_size, self._beam_width).cpu().int()
+        ctc_decode.paddle_beam_decode_with_given_state(self._decoder, probs, seq_lens,
+                                                       [state.state for state in states],
+                                                       [int(bool(is_eos)) for is_eos in is_eos_s],
+                                                       output, timesteps, scores, out_seq_len)
 
         return output, scores, timesteps, out_seq_len
 
@@ -54,3 +186,28 @@ class CTCBeamDecoder(object):
     def reset_params(self, alpha, beta):
         if self._scorer is not None:
             ctc_decode.reset_params(self._scorer, alpha, beta)
+
+    def lm_cache_stats(self):
+        if self._scorer is None:
+            return None
+        hits, misses = ctc_decode.get_cache_hits(self._scorer), ctc_decode.get_cache_misses(self._scorer)
+        return {'hits': hits, 'misses': misses, 'hit_rate': float(hits) / max(hits + misses, 1)}
+
+    def __del__(self):
+        if getattr(self, '_decoder', None) is not None:
+            ctc_decode.paddle_release_decoder(self._decoder)
+        if getattr(self, '_scorer', None) is not None:
+            ctc_decode.paddle_release_scorer(self._scorer)
+
+
+class DecoderState(object):
+    """Beam search state of one audio stream, fed chunk by chunk through CTCBeamDecoder.decode_online."""
+
+    def __init__(self, decoder):
+        self.num_frames = 0
+        # the state refers to the decoder's scorer, keep it alive
+        self._decoder = decoder
+        self.state = ctc_decode.paddle_get_decoder_state(decoder._decoder)
+
+    def __del__(self):
+        ctc_decode.paddle_release_state(self.state)
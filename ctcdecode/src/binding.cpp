@@ -1,19 +1,138 @@
 #include <algorithm>
 #include <iostream>
+#include <limits>
 #include <string>
+#include <utility>
 #include <vector>
 #include "TH.h"
 #include "scorer.h"
 #include "ctc_beam_search_decoder.h"
+#include "decoder.h"
 #include "decoder_utils.h"
 
-int uxxxx_string_to_uxxxx_char_vec(const char* labels, std::vector<std::string>& new_vocab) {
+void uxxxx_string_to_uxxxx_char_vec(const char* labels, std::vector<std::string>& new_vocab) {
   // Todo: don't assume the values are comma seperated.
   const std::string labels_str(labels);
   std::string delimiter = ",";
   new_vocab = split_str(labels_str, delimiter);
 }
 
+std::vector<ProbsView> get_inputs(THFloatTensor *th_probs,
+                                  THIntTensor *th_seq_lens) {
+    const int64_t max_time = THFloatTensor_size(th_probs, 1);
+    const int64_t batch_size = THFloatTensor_size(th_probs, 0);
+    const int64_t num_classes = THFloatTensor_size(th_probs, 2);
+    const float *probs = THFloatTensor_data(th_probs);
+    const int64_t batch_stride = THFloatTensor_stride(th_probs, 0);
+    const int64_t time_stride = THFloatTensor_stride(th_probs, 1);
+    const int64_t class_stride = THFloatTensor_stride(th_probs, 2);
+
+    // the decoder reads the tensor in place through the views
+    std::vector<ProbsView> inputs;
+    for (int b=0; b < batch_size; ++b) {
+        // avoid a crash by ensuring that an erroneous seq_len doesn't have us try to access memory we shouldn't
+        int seq_len = std::max(std::min(THIntTensor_get1d(th_seq_lens, b), (int)max_time), 0);
+        inputs.emplace_back(probs + b * batch_stride, seq_len, num_classes, time_stride, class_stride);
+    }
+    return inputs;
+}
+
+// copy values to data, stride elements apart
+static void copy_strided(const std::vector<int> &values, int *data, int64_t stride) {
+    if (stride == 1) {
+        std::copy(values.begin(), values.end(), data);
+        return;
+    }
+    for (size_t t = 0; t < values.size(); ++t) {
+        data[t * stride] = values[t];
+    }
+}
+
+void set_outputs(const std::vector<std::vector<std::pair<double, Output>>> &batch_results,
+                 THIntTensor *th_output,
+                 THIntTensor *th_timesteps,
+                 THFloatTensor *th_scores,
+                 THIntTensor *th_out_length) {
+    int *output = THIntTensor_data(th_output);
+    int *timesteps = THIntTensor_data(th_timesteps);
+    for (int b = 0; b < batch_results.size(); ++b){
+        const std::vector<std::pair<double, Output>> &results = batch_results[b];
+        for (int p = 0; p < results.size();++p){
+            const Output &path = results[p].second;
+            // fill output tokens and their timesteps, row by row
+            copy_strided(path.tokens,
+                         output + b * THIntTensor_stride(th_output, 0) + p * THIntTensor_stride(th_output, 1),
+                         THIntTensor_stride(th_output, 2));
+            copy_strided(path.timesteps,
+                         timesteps + b * THIntTensor_stride(th_timesteps, 0) + p * THIntTensor_stride(th_timesteps, 1),
+                         THIntTensor_stride(th_timesteps, 2));
+            THFloatTensor_set2d(th_scores, b, p, results[p].first); // fill path scores
+            THIntTensor_set2d(th_out_length, b, p, path.tokens.size());
+        }
+    }
+}
+
+// Fill the num_results best paths of each sample as ragged outputs: the
+// tokens and timesteps of every path concatenated, path p of sample b
+// spanning [offsets[b * num_results + p], offsets[b * num_results + p + 1]).
+// Samples with fewer paths get empty ones, with an infinite score.
+void set_ragged_outputs(const std::vector<std::vector<std::pair<double, Output>>> &batch_results,
+                        size_t num_results,
+                        THIntTensor *th_tokens,
+                        THIntTensor *th_timesteps,
+                        THIntTensor *th_offsets,
+                        THFloatTensor *th_scores) {
+    size_t batch_size = batch_results.size();
+    THIntTensor_resize1d(th_offsets, batch_size * num_results + 1);
+    THFloatTensor_resize2d(th_scores, batch_size, num_results);
+    int *offsets = THIntTensor_data(th_offsets);
+    float *scores = THFloatTensor_data(th_scores);
+
+    // sized first, so that the paths are copied once into their place
+    offsets[0] = 0;
+    for (size_t b = 0; b < batch_size; ++b) {
+        const std::vector<std::pair<double, Output>> &results = batch_results[b];
+        for (size_t p = 0; p < num_results; ++p) {
+            size_t i = b * num_results + p;
+            bool found = p < results.size();
+            offsets[i + 1] = offsets[i] + (found ? results[p].second.tokens.size() : 0);
+            scores[i] = found ? results[p].first : std::numeric_limits<float>::infinity();
+        }
+    }
+
+    THIntTensor_resize1d(th_tokens, offsets[batch_size * num_results]);
+    THIntTensor_resize1d(th_timesteps, offsets[batch_size * num_results]);
+    int *tokens = THIntTensor_data(th_tokens);
+    int *timesteps = THIntTensor_data(th_timesteps);
+    for (size_t b = 0; b < batch_size; ++b) {
+        const std::vector<std::pair<double, Output>> &results = batch_results[b];
+        for (size_t p = 0; p < num_results && p < results.size(); ++p) {
+            const Output &path = results[p].second;
+            int offset = offsets[b * num_results + p];
+            std::copy(path.tokens.begin(), path.tokens.end(), tokens + offset);
+            std::copy(path.timesteps.begin(), path.timesteps.end(), timesteps + offset);
+        }
+    }
+}
+
+// one row of DecoderStats::to_vector() per sample
+void set_stats(const std::vector<DecoderStats> &stats, THDoubleTensor *th_stats) {
+    size_t num_fields = DecoderStats().to_vector().size();
+    THDoubleTensor_resize2d(th_stats, stats.size(), num_fields);
+    double *data = THDoubleTensor_data(th_stats);
+    for (size_t b = 0; b < stats.size(); ++b) {
+        std::vector<double> fields = stats[b].to_vector();
+        std::copy(fields.begin(), fields.end(), data + b * num_fields);
+    }
+}
+
+// 1 for each sample whose beam was narrowed to meet the deadline, else 0
+void set_degraded(const std::vector<bool> &degraded, THIntTensor *th_degraded) {
+    THIntTensor_resize1d(th_degraded, degraded.size());
+    int *data = THIntTensor_data(th_degraded);
+    std::copy(degraded.begin(), degraded.end(), data);
+}
+
 int beam_decode(THFloatTensor *th_probs,
                 THIntTensor *th_seq_lens,
                 const char* labels,
@@ -35,42 +154,12 @@ int beam_decode(THFloatTensor *th_probs,
     if (scorer != NULL) {
         ext_scorer = static_cast<Scorer *>(scorer);
     }
-    const int64_t max_time = THFloatTensor_size(th_probs, 1);
-    const int64_t batch_size = THFloatTensor_size(th_probs, 0);
-    const int64_t num_classes = THFloatTensor_size(th_probs, 2);
-
-    std::vector<std::vector<std::vector<double>>> inputs;
-    for (int b=0; b < batch_size; ++b) {
-        // avoid a crash by ensuring that an erroneous seq_len doesn't have us try to access memory we shouldn't
-        int seq_len = std::min(THIntTensor_get1d(th_seq_lens, b), (int)max_time);
-        std::vector<std::vector<double>> temp (seq_len, std::vector<double>(num_classes));
-        for (int t=0; t < seq_len; ++t) {
-            for (int n=0; n < num_classes; ++n) {
-                float val = THFloatTensor_get3d(th_probs, b, t, n);
-                temp[t][n] = val;
-            }
-        }
-        inputs.push_back(temp);
-    }
+    std::vector<ProbsView> inputs = get_inputs(th_probs, th_seq_lens);
 
     std::vector<std::vector<std::pair<double, Output>>> batch_results =
     ctc_beam_search_decoder_batch(inputs, new_vocab, beam_size, num_processes, cutoff_prob, cutoff_top_n, blank_id, ext_scorer);
 
-    for (int b = 0; b < batch_results.size(); ++b){
-        std::vector<std::pair<double, Output>> results = batch_results[b];
-        for (int p = 0; p < results.size();++p){
-            std::pair<double, Output> n_path_result = results[p];
-            Output output = n_path_result.second;
-            std::vector<int> output_tokens = output.tokens;
-            std::vector<int> output_timesteps = output.timesteps;
-            for (int t = 0; t < output_tokens.size(); ++t){
-                THIntTensor_set3d(th_output, b, p, t, output_tokens[t]); // fill output tokens
-                THIntTensor_set3d(th_timesteps, b, p, t, output_timesteps[t]); // fill timesteps tokens
-            }
-            THFloatTensor_set2d(th_scores, b, p, n_path_result.first); // fill path scores
-            THIntTensor_set2d(th_out_length, b, p, output_tokens.size());
-        }
-    }
+    set_outputs(batch_results, th_output, th_timesteps, th_scores, th_out_length);
     return 1;
 }
 
@@ -78,6 +167,9 @@ int beam_decode(THFloatTensor *th_probs,
 extern "C"
 {
 #include "binding.h"
+        // the original entry points, whose signatures are kept for their
+        // callers; they decode probabilities, the options added since are
+        // only taken by the decoder handle functions below
         int paddle_beam_decode(THFloatTensor *th_probs,
                                THIntTensor *th_seq_lens,
                                const char* labels,
@@ -93,7 +185,7 @@ extern "C"
                                THIntTensor *th_out_length){
 
             return beam_decode(th_probs, th_seq_lens, labels, vocab_size, beam_size, num_processes,
-                        cutoff_prob, cutoff_top_n, blank_id,NULL, th_output, th_timesteps, th_scores, th_out_length);
+                        cutoff_prob, cutoff_top_n, blank_id, NULL, th_output, th_timesteps, th_scores, th_out_length);
         }
 
         int paddle_beam_decode_lm(THFloatTensor *th_probs,
@@ -112,24 +204,189 @@ extern "C"
                                   THIntTensor *th_out_length){
 
             return beam_decode(th_probs, th_seq_lens, labels, vocab_size, beam_size, num_processes,
-                        cutoff_prob, cutoff_top_n, blank_id,scorer, th_output, th_timesteps, th_scores, th_out_length);
+                        cutoff_prob, cutoff_top_n, blank_id, scorer, th_output, th_timesteps, th_scores, th_out_length);
         }
 
 
+    void* paddle_get_decoder(const char* labels,
+                             int vocab_size,
+                             size_t beam_size,
+                             size_t num_processes,
+                             double cutoff_prob,
+                             size_t cutoff_top_n,
+                             size_t blank_id,
+                             int log_probs_input,
+                             double blank_skip_threshold,
+                             double beam_threshold,
+                             size_t min_beam_size,
+                             size_t min_cutoff_top_n,
+                             size_t num_expansion_threads,
+                             void *scorer) {
+        std::vector<std::string> new_vocab;
+        uxxxx_string_to_uxxxx_char_vec(labels, new_vocab);
+        Scorer *ext_scorer = static_cast<Scorer *>(scorer);
+        Decoder *decoder = new Decoder(new_vocab, beam_size, num_processes, cutoff_prob, cutoff_top_n, blank_id,
+                                       ext_scorer, log_probs_input != 0, blank_skip_threshold,
+                                       beam_threshold, min_beam_size, min_cutoff_top_n,
+                                       num_expansion_threads);
+        return static_cast<void*>(decoder);
+    }
+
+    void paddle_release_decoder(void *decoder) {
+        delete static_cast<Decoder *>(decoder);
+    }
+
+    int paddle_beam_decode_with_decoder(void *decoder,
+                                        THFloatTensor *th_probs,
+                                        THIntTensor *th_seq_lens,
+                                        THIntTensor *th_output,
+                                        THIntTensor *th_timesteps,
+                                        THFloatTensor *th_scores,
+                                        THIntTensor *th_out_length,
+                                        double batch_time_budget_ms,
+                                        double utterance_time_budget_ms,
+                                        THDoubleTensor *th_stats,
+                                        THIntTensor *th_degraded){
+        std::vector<ProbsView> inputs = get_inputs(th_probs, th_seq_lens);
+
+        // the counters are only collected when asked for
+        std::vector<DecoderStats> stats;
+        std::vector<bool> degraded;
+        std::vector<std::vector<std::pair<double, Output>>> batch_results =
+        static_cast<Decoder *>(decoder)->decode(inputs, th_stats != NULL ? &stats : NULL,
+                                                batch_time_budget_ms, utterance_time_budget_ms,
+                                                th_degraded != NULL ? &degraded : NULL);
+
+        set_outputs(batch_results, th_output, th_timesteps, th_scores, th_out_length);
+        if (th_stats != NULL) {
+            set_stats(stats, th_stats);
+        }
+        if (th_degraded != NULL) {
+            set_degraded(degraded, th_degraded);
+        }
+        return 1;
+    }
+
+    int paddle_beam_decode_ragged_with_decoder(void *decoder,
+                                               THFloatTensor *th_probs,
+                                               THIntTensor *th_seq_lens,
+                                               int num_results,
+                                               THIntTensor *th_tokens,
+                                               THIntTensor *th_timesteps,
+                                               THIntTensor *th_offsets,
+                                               THFloatTensor *th_scores,
+                                               double batch_time_budget_ms,
+                                               double utterance_time_budget_ms,
+                                               THDoubleTensor *th_stats,
+                                               THIntTensor *th_degraded){
+        VALID_CHECK_GT(num_results, 0, "num_results must be positive");
+        std::vector<ProbsView> inputs = get_inputs(th_probs, th_seq_lens);
+
+        std::vector<DecoderStats> stats;
+        std::vector<bool> degraded;
+        std::vector<std::vector<std::pair<double, Output>>> batch_results =
+        static_cast<Decoder *>(decoder)->decode(inputs, th_stats != NULL ? &stats : NULL,
+                                                batch_time_budget_ms, utterance_time_budget_ms,
+                                                th_degraded != NULL ? &degraded : NULL);
+
+        set_ragged_outputs(batch_results, num_results, th_tokens, th_timesteps, th_offsets, th_scores);
+        if (th_stats != NULL) {
+            set_stats(stats, th_stats);
+        }
+        if (th_degraded != NULL) {
+            set_degraded(degraded, th_degraded);
+        }
+        return 1;
+    }
+
+    int paddle_greedy_decode_with_decoder(void *decoder,
+                                          THFloatTensor *th_probs,
+                                          THIntTensor *th_seq_lens,
+                                          THIntTensor *th_tokens,
+                                          THIntTensor *th_timesteps,
+                                          THIntTensor *th_offsets,
+                                          THFloatTensor *th_scores){
+        std::vector<ProbsView> inputs = get_inputs(th_probs, th_seq_lens);
+
+        std::vector<std::pair<double, Output>> paths =
+        static_cast<Decoder *>(decoder)->decode_greedy(inputs);
+
+        // the ragged outputs of a single path per sample
+        std::vector<std::vector<std::pair<double, Output>>> batch_results(paths.size());
+        for (size_t b = 0; b < paths.size(); ++b) {
+            batch_results[b].push_back(std::move(paths[b]));
+        }
+        set_ragged_outputs(batch_results, 1, th_tokens, th_timesteps, th_offsets, th_scores);
+        return 1;
+    }
+
+    int paddle_beam_decode_with_given_state(void *decoder,
+                                            THFloatTensor *th_probs,
+                                            THIntTensor *th_seq_lens,
+                                            void **states,
+                                            const int *is_eos_s,
+                                            THIntTensor *th_output,
+                                            THIntTensor *th_timesteps,
+                                            THFloatTensor *th_scores,
+                                            THIntTensor *th_out_length){
+        std::vector<ProbsView> inputs = get_inputs(th_probs, th_seq_lens);
+        std::vector<DecoderState *> decoder_states;
+        std::vector<bool> is_eos;
+        for (size_t b = 0; b < inputs.size(); ++b) {
+            decoder_states.push_back(static_cast<DecoderState *>(states[b]));
+            is_eos.push_back(is_eos_s[b] != 0);
+        }
+
+        std::vector<std::vector<std::pair<double, Output>>> batch_results =
+        static_cast<Decoder *>(decoder)->decode_with_given_state(inputs, decoder_states, is_eos);
+
+        set_outputs(batch_results, th_output, th_timesteps, th_scores, th_out_length);
+        return 1;
+    }
+
+    void* paddle_get_decoder_state(void *decoder) {
+        return static_cast<void*>(static_cast<Decoder *>(decoder)->create_state());
+    }
+
+    void paddle_release_state(void *state) {
+        delete static_cast<DecoderState *>(state);
+    }
+
     void* paddle_get_scorer(double alpha,
                             double beta,
                             const char* lm_path,
                             const char* labels,
                             const char* tokenization_labels,
                             int vocab_size) {
+        return paddle_get_scorer_with_options(alpha, beta, lm_path, labels, tokenization_labels, vocab_size,
+                                              NULL, util::LAZY);
+    }
+
+    void* paddle_get_scorer_with_options(double alpha,
+                                         double beta,
+                                         const char* lm_path,
+                                         const char* labels,
+                                         const char* tokenization_labels,
+                                         int vocab_size,
+                                         const char* dictionary_cache_dir,
+                                         int load_method) {
+        // one of the values of util::LoadMethod
+        VALID_CHECK(load_method >= util::LAZY && load_method <= util::PARALLEL_READ,
+                    "Invalid language model load method");
         std::vector<std::string> new_vocab;
         std::vector<std::string> new_tokenization_vocab;
         uxxxx_string_to_uxxxx_char_vec(labels, new_vocab);
         uxxxx_string_to_uxxxx_char_vec(tokenization_labels, new_tokenization_vocab);
-        Scorer* scorer = new Scorer(alpha, beta, lm_path, new_vocab, new_tokenization_vocab);
+        Scorer* scorer = new Scorer(alpha, beta, lm_path, new_vocab, new_tokenization_vocab,
+                                    dictionary_cache_dir != NULL ? dictionary_cache_dir : "",
+                                    static_cast<util::LoadMethod>(load_method));
         return static_cast<void*>(scorer);
     }
 
+    void paddle_release_scorer(void *scorer) {
+        delete static_cast<Scorer *>(scorer);
+    }
+
     int is_character_based(void *scorer){
         Scorer *ext_scorer  = static_cast<Scorer *>(scorer);
         return ext_scorer->is_character_based();
@@ -147,4 +404,17 @@ extern "C"
         Scorer *ext_scorer  = static_cast<Scorer *>(scorer);
         ext_scorer->reset_params(alpha, beta);
     }
+
+    void set_cache_capacity(void *scorer, size_t capacity){
+        Scorer *ext_scorer  = static_cast<Scorer *>(scorer);
+        ext_scorer->set_cache_capacity(capacity);
+    }
+    size_t get_cache_hits(void *scorer){
+        Scorer *ext_scorer  = static_cast<Scorer *>(scorer);
+        return ext_scorer->get_cache() ? ext_scorer->get_cache()->hits() : 0;
+    }
+    size_t get_cache_misses(void *scorer){
+        Scorer *ext_scorer  = static_cast<Scorer *>(scorer);
+        return ext_scorer->get_cache() ? ext_scorer->get_cache()->misses() : 0;
+    }
 }
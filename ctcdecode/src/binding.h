@@ -27,6 +27,70 @@ int paddle_beam_decode_lm(THFloatTensor *th_probs,
                           THFloatTensor *th_scores,
                           THIntTensor *th_out_length);
 
+void* paddle_get_decoder(const char* labels,
+                         int vocab_size,
+                         size_t beam_size,
+                         size_t num_processes,
+                         double cutoff_prob,
+                         size_t cutoff_top_n,
+                         size_t blank_id,
+                         int log_probs_input,
+                         double blank_skip_threshold,
+                         double beam_threshold,
+                         size_t min_beam_size,
+                         size_t min_cutoff_top_n,
+                         size_t num_expansion_threads,
+                         void *scorer);
+
+void paddle_release_decoder(void *decoder);
+
+int paddle_beam_decode_with_decoder(void *decoder,
+                                    THFloatTensor *th_probs,
+                                    THIntTensor *th_seq_lens,
+                                    THIntTensor *th_output,
+                                    THIntTensor *th_timesteps,
+                                    THFloatTensor *th_scores,
+                                    THIntTensor *th_out_length,
+                                    double batch_time_budget_ms,
+                                    double utterance_time_budget_ms,
+                                    THDoubleTensor *th_stats,
+                                    THIntTensor *th_degraded);
+
+int paddle_beam_decode_ragged_with_decoder(void *decoder,
+                                           THFloatTensor *th_probs,
+                                           THIntTensor *th_seq_lens,
+                                           int num_results,
+                                           THIntTensor *th_tokens,
+                                           THIntTensor *th_timesteps,
+                                           THIntTensor *th_offsets,
+                                           THFloatTensor *th_scores,
+                                           double batch_time_budget_ms,
+                                           double utterance_time_budget_ms,
+                                           THDoubleTensor *th_stats,
+                                           THIntTensor *th_degraded);
+
+int paddle_greedy_decode_with_decoder(void *decoder,
+                                      THFloatTensor *th_probs,
+                                      THIntTensor *th_seq_lens,
+                                      THIntTensor *th_tokens,
+                                      THIntTensor *th_timesteps,
+                                      THIntTensor *th_offsets,
+                                      THFloatTensor *th_scores);
+
+int paddle_beam_decode_with_given_state(void *decoder,
+                                        THFloatTensor *th_probs,
+                                        THIntTensor *th_seq_lens,
+                                        void **states,
+                                        const int *is_eos_s,
+                                        THIntTensor *th_output,
+                                        THIntTensor *th_timesteps,
+                                        THFloatTensor *th_scores,
+                                        THIntTensor *th_out_length);
+
+void* paddle_get_decoder_state(void *decoder);
+
+void paddle_release_state(void *state);
+
 void* paddle_get_scorer(double alpha,
                         double beta,
                         const char* lm_path,
@@ -34,7 +98,21 @@ void* paddle_get_scorer(double alpha,
                         const char* tokenization_labels,
                         int vocab_size);
 
+void* paddle_get_scorer_with_options(double alpha,
+                                     double beta,
+                                     const char* lm_path,
+                                     const char* labels,
+                                     const char* tokenization_labels,
+                                     int vocab_size,
+                                     const char* dictionary_cache_dir,
+                                     int load_method);
+
+void paddle_release_scorer(void *scorer);
+
 int is_character_based(void *scorer);
 size_t get_max_order(void *scorer);
 size_t get_dict_size(void *scorer);
 void reset_params(void *scorer, double alpha, double beta);
+void set_cache_capacity(void *scorer, size_t capacity);
+size_t get_cache_hits(void *scorer);
+size_t get_cache_misses(void *scorer);
@@ -1,210 +1,679 @@
 #include "ctc_beam_search_decoder.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <iostream>
 #include <limits>
 #include <map>
 #include <utility>
 
+#include "decoder.h"
 #include "decoder_utils.h"
 #include "ThreadPool.h"
-#include "fst/fstlib.h"
 #include "path_trie.h"
 
-using FSTMATCH = fst::SortedMatcher<fst::StdVectorFst>;
+typedef std::chrono::steady_clock StatsClock;
 
-std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
-    const std::vector<std::vector<double>> &probs_seq,
-    const std::vector<std::string> &vocabulary,
-    size_t beam_size,
-    double cutoff_prob,
-    size_t cutoff_top_n,
-    size_t blank_id,
-    Scorer *ext_scorer) {
+// milliseconds elapsed since start, which is moved to now
+static double lap_ms(StatsClock::time_point *start) {
+  StatsClock::time_point now = StatsClock::now();
+  double ms = std::chrono::duration<double, std::milli>(now - *start).count();
+  *start = now;
+  return ms;
+}
+
+DecoderState::DecoderState(const std::vector<std::string> &vocabulary,
+                           size_t beam_size,
+                           double cutoff_prob,
+                           size_t cutoff_top_n,
+                           size_t blank_id,
+                           Scorer *ext_scorer,
+                           bool log_probs_input,
+                           double blank_skip_threshold,
+                           double beam_threshold,
+                           size_t min_beam_size,
+                           size_t min_cutoff_top_n)
+    : vocab_size_(vocabulary.size()),
+      beam_size_(beam_size),
+      cutoff_prob_(cutoff_prob),
+      cutoff_top_n_(cutoff_top_n),
+      blank_id_(blank_id),
+      ext_scorer_(ext_scorer),
+      log_probs_input_(log_probs_input),
+      blank_skip_threshold_(blank_skip_threshold),
+      beam_threshold_(beam_threshold),
+      min_beam_size_(min_beam_size),
+      min_cutoff_top_n_(min_cutoff_top_n),
+      max_top_n_(cutoff_prob < 1.0 ? cutoff_top_n : vocabulary.size()),
+      abs_time_step_(0),
+      finalized_(false),
+      collect_stats_(false),
+      has_deadline_(false),
+      deadline_window_steps_(0),
+      deadline_beam_size_(beam_size),
+      deadline_cutoff_top_n_(max_top_n_),
+      degraded_(false),
+      expansion_pool_(nullptr),
+      num_expansion_tasks_(1) {
+  // init prefixes' root
+  root_.score = root_.log_prob_b_prev = 0.0;
+  root_.set_arena(&arena_);
+  root_.set_active_list(&active_);
+  prefixes_.push_back(&root_);
+
+  VALID_CHECK(min_beam_size <= beam_size,
+              "min_beam_size must not be greater than beam_size");
+  VALID_CHECK(min_cutoff_top_n <= cutoff_top_n,
+              "min_cutoff_top_n must not be greater than cutoff_top_n");
+
+  if (ext_scorer != nullptr && !ext_scorer->is_character_based()) {
+    // the dictionary is immutable and shared by every state
+    root_.set_dictionary(ext_scorer->get_dictionary());
+  }
+}
+
+void DecoderState::set_deadline(StatsClock::time_point deadline) {
+  has_deadline_ = true;
+  deadline_ = deadline;
+  deadline_beam_size_ = beam_size_;
+  deadline_cutoff_top_n_ = max_top_n_;
+}
+
+void DecoderState::keep_deadline(size_t time_step, size_t num_time_steps) {
+  StatsClock::time_point now = StatsClock::now();
+  // the time between next() calls doesn't count
+  if (time_step == 0) {
+    deadline_window_start_ = now;
+    deadline_window_steps_ = 0;
+  }
+  double remaining_ms = std::chrono::duration<double, std::milli>(deadline_ - now).count();
+  if (remaining_ms <= 0.0) {
+    // out of time, best path
+    deadline_beam_size_ = 1;
+    deadline_cutoff_top_n_ = 1;
+  } else if (deadline_window_steps_ >= kDeadlineWindow) {
+    // mean time per time step since the beam last changed
+    double window_ms = std::chrono::duration<double, std::milli>(
+        now - deadline_window_start_).count();
+    double time_step_ms = window_ms / deadline_window_steps_;
+    if (time_step_ms * (num_time_steps - time_step) > remaining_ms) {
+      // the time per time step roughly halves with the beam, it is halved
+      // again after another window if that isn't enough
+      deadline_beam_size_ = std::max<size_t>(deadline_beam_size_ / 2, 1);
+      deadline_cutoff_top_n_ = std::max<size_t>(deadline_cutoff_top_n_ / 2, 1);
+      deadline_window_start_ = now;
+      deadline_window_steps_ = 0;
+    }
+  }
+  ++deadline_window_steps_;
+}
+
+void DecoderState::next(const std::vector<std::vector<double>> &probs_seq) {
+  std::vector<float> buffer;
+  next(make_probs_view(probs_seq, &buffer));
+}
+
+void DecoderState::next(const ProbsView &probs) {
+  VALID_CHECK(!finalized_, "next() called on a finalized decoder state");
+  size_t num_time_steps = probs.num_time_steps;
   // dimension check
-  size_t num_time_steps = probs_seq.size();
-  for (size_t i = 0; i < num_time_steps; ++i) {
-    VALID_CHECK_EQ(probs_seq[i].size(),
-                   vocabulary.size(),
+  if (num_time_steps > 0) {
+    VALID_CHECK_EQ(probs.num_classes,
+                   vocab_size_,
                    "The shape of probs_seq does not match with "
                    "the shape of the vocabulary");
   }
-  // init prefixes' root
-  PathTrie root;
-  root.score = root.log_prob_b_prev = 0.0;
-  std::vector<PathTrie *> prefixes;
-  prefixes.push_back(&root);
 
-  if (ext_scorer != nullptr && !ext_scorer->is_character_based()) {
-    auto fst_dict = static_cast<fst::StdVectorFst *>(ext_scorer->dictionary);
-    fst::StdVectorFst *dict_ptr = fst_dict->Copy(true);
-    root.set_dictionary(dict_ptr);
-    auto matcher = std::make_shared<FSTMATCH>(*dict_ptr, fst::MATCH_INPUT);
-    root.set_matcher(matcher);
+  // blank probability from which a time step is skipped, in the input domain
+  float blank_skip_cutoff = NUM_FLT_INF;
+  if (blank_skip_threshold_ < 1.0) {
+    blank_skip_cutoff = log_probs_input_ ? std::log(blank_skip_threshold_)
+                                         : blank_skip_threshold_;
   }
 
+  // the expansion threads count into their own stats, see expand_parallel
+  DecoderStats *stats = collect_stats_ ? &stats_ : nullptr;
+  StatsClock::time_point start;
+
   // prefix search over time
   for (size_t time_step = 0; time_step < num_time_steps; ++time_step) {
-    auto &prob = probs_seq[time_step];
+    if (stats != nullptr) {
+      ++stats->num_frames;
+    }
+    if (has_deadline_) {
+      keep_deadline(time_step, num_time_steps);
+    }
+    if (probs.at(time_step, blank_id_) >= blank_skip_cutoff) {
+      skip_blank_frame(probs, time_step);
+      if (stats != nullptr) {
+        ++stats->num_skipped_frames;
+      }
+      continue;
+    }
+    if (stats != nullptr) {
+      start = StatsClock::now();
+    }
+
+    get_pruned_log_probs(probs, time_step, cutoff_prob_, cutoff_top_n_,
+                         log_probs_input_, &log_prob_idx_);
+    const auto &log_prob_idx = log_prob_idx_;
+
+    // adaptive beam: the beam width and the number of candidates of this
+    // time step grow with the entropy of its candidates, from their minimum
+    // for a confident time step to beam_size_ and max_top_n_
+    size_t beam_size = beam_size_;
+    size_t top_n = log_prob_idx_.size();
+    if (min_beam_size_ > 0 || min_cutoff_top_n_ > 0) {
+      float entropy = normalized_entropy(log_prob_idx_);
+      if (min_beam_size_ > 0) {
+        beam_size = min_beam_size_ + static_cast<size_t>(std::lround(
+            entropy * (beam_size_ - min_beam_size_)));
+      }
+      if (min_cutoff_top_n_ > 0 && min_cutoff_top_n_ < max_top_n_) {
+        top_n = std::min(top_n, min_cutoff_top_n_ + static_cast<size_t>(std::lround(
+            entropy * (max_top_n_ - min_cutoff_top_n_))));
+      }
+    }
+    // narrower still if the deadline requires it, see keep_deadline()
+    if (deadline_beam_size_ < beam_size || deadline_cutoff_top_n_ < top_n) {
+      beam_size = std::min(beam_size, deadline_beam_size_);
+      top_n = std::min(top_n, deadline_cutoff_top_n_);
+      degraded_ = true;
+      if (stats != nullptr) {
+        ++stats->num_degraded_frames;
+      }
+    }
+    if (top_n < log_prob_idx_.size()) {
+      // the candidates are only sorted if they were pruned
+      std::partial_sort(log_prob_idx_.begin(),
+                        log_prob_idx_.begin() + top_n,
+                        log_prob_idx_.end(),
+                        pair_comp_second_rev<size_t, float>);
+      log_prob_idx_.resize(top_n);
+    }
 
+    // the expansion of a character stops at the first prefix whose
+    // extension is below min_cutoff, if apply_cutoff is set, so the
+    // prefixes are sorted by score
     float min_cutoff = -NUM_FLT_INF;
-    bool full_beam = false;
-    if (ext_scorer != nullptr) {
-      size_t num_prefixes = std::min(prefixes.size(), beam_size);
+    bool apply_cutoff = false;
+    size_t num_prefixes = std::min(prefixes_.size(), beam_size_);
+    if (ext_scorer_ != nullptr || beam_threshold_ > 0.0) {
       std::sort(
-          prefixes.begin(), prefixes.begin() + num_prefixes, prefix_compare);
-      min_cutoff = prefixes[num_prefixes - 1]->score +
-                   std::log(prob[blank_id]) - std::max(0.0, ext_scorer->beta);
-      full_beam = (num_prefixes == beam_size);
+          prefixes_.begin(), prefixes_.begin() + num_prefixes, prefix_compare);
+    }
+    // an extension below the blank extension of the last prefix of a full
+    // beam doesn't make it into the beam
+    if (ext_scorer_ != nullptr && num_prefixes >= beam_size) {
+      float blank_prob = probs.at(time_step, blank_id_);
+      min_cutoff = prefixes_[beam_size - 1]->score +
+                   (log_probs_input_ ? blank_prob : std::log(blank_prob)) -
+                   std::max(0.0f, static_cast<float>(ext_scorer_->beta));
+      apply_cutoff = true;
     }
 
-    std::vector<std::pair<size_t, float>> log_prob_idx =
-        get_pruned_log_probs(prob, cutoff_prob, cutoff_top_n);
-    
-    // loop over chars
-    for (size_t index = 0; index < log_prob_idx.size(); index++) {
-      auto c = log_prob_idx[index].first;
-      auto log_prob_c = log_prob_idx[index].second;
+    // beam threshold: drop the extensions more than beam_threshold_ below
+    // the best one, that of the best prefix by the most probable character
+    if (beam_threshold_ > 0.0 && !log_prob_idx.empty()) {
+      float max_log_prob = -NUM_FLT_INF;
+      for (const auto &entry : log_prob_idx) {
+        max_log_prob = std::max(max_log_prob, entry.second);
+      }
+      float threshold_cutoff = prefixes_[0]->score + max_log_prob -
+                               static_cast<float>(beam_threshold_);
+      min_cutoff = apply_cutoff ? std::max(min_cutoff, threshold_cutoff)
+                                : threshold_cutoff;
+      apply_cutoff = true;
+    }
+    if (stats != nullptr) {
+      stats->pruning_ms += lap_ms(&start);
+    }
 
-      for (size_t i = 0; i < prefixes.size() && i < beam_size; ++i) {
-        auto prefix = prefixes[i];
+    if (expansion_pool_ != nullptr) {
+      expand_parallel(log_prob_idx, min_cutoff, apply_cutoff);
+    } else {
+      // loop over chars
+      for (size_t index = 0; index < log_prob_idx.size(); index++) {
+        auto c = log_prob_idx[index].first;
+        auto log_prob_c = log_prob_idx[index].second;
 
-        if (full_beam && log_prob_c + prefix->score < min_cutoff) {
-          break;
-        }
-        // blank
-        if (c == blank_id) {
-          prefix->log_prob_b_cur =
-              log_sum_exp(prefix->log_prob_b_cur, log_prob_c + prefix->score);
-          continue;
-        }
-        // repeated character
-        if (c == prefix->character) {
-          prefix->log_prob_nb_cur = log_sum_exp(
-              prefix->log_prob_nb_cur, log_prob_c + prefix->log_prob_nb_prev);
-        }
-        // get new prefix
-        bool ignore_tokenization_symbol = (ext_scorer != nullptr && (ext_scorer->tokenization_char_map_.find(c) !=
-                                                                    ext_scorer->tokenization_char_map_.end()));
-        auto prefix_new = prefix->get_path_trie(c, time_step, ignore_tokenization_symbol);
-        
-        if (prefix_new != nullptr) {
-          float log_p = -NUM_FLT_INF;
-          
-          if (c == prefix->character &&
-              prefix->log_prob_b_prev > -NUM_FLT_INF) {
-            log_p = log_prob_c + prefix->log_prob_b_prev;
-          } else if (c != prefix->character) {
-            log_p = log_prob_c + prefix->score;
+        for (size_t i = 0; i < prefixes_.size() && i < beam_size_; ++i) {
+          auto prefix = prefixes_[i];
+
+          if (apply_cutoff && log_prob_c + prefix->score < min_cutoff) {
+            break;
           }
-          // language model scoring
-          if (ext_scorer != nullptr &&
-              (ext_scorer->tokenization_char_map_.find(c) != ext_scorer->tokenization_char_map_.end() ||
-               ext_scorer->is_character_based())) {
-            // character based
-            if (ext_scorer->is_character_based()){
-              PathTrie *prefix_to_score = nullptr;
-              prefix_to_score = prefix_new;
-              float score = 0.0;
-              std::vector<std::string> ngram;
-              ngram = ext_scorer->make_ngram(prefix_to_score);
-              score = ext_scorer->get_log_cond_prob(ngram) * ext_scorer->alpha;
-              log_p += score;
-              log_p += ext_scorer->beta;
-            }
-            else{ // word based
-              /*
-              Algorithm:
-              If current is tokenization symbol:
-                 1 prefix_new_score = ngram_score(prefix_new)
-                 2 if prefix->character is not tokenization character
-                         prefix_score = ngram_score(prefix)
-                     else
-                         prefix_score <- 0.0
-                 3 score = prefix_new_score + prefix_score (log scale sum)
-              */
-              float score;
-              float prefix_new_log_cond_prob;
-              std::vector<std::string> prefix_new_ngram;
-              prefix_new_ngram = ext_scorer->make_ngram(prefix_new);
-              prefix_new_log_cond_prob = ext_scorer->get_log_cond_prob(prefix_new_ngram);
-
-              if(ext_scorer->tokenization_char_map_.find(prefix->character) == ext_scorer->tokenization_char_map_.end()){
-                float prefix_log_cond_prob;
-                std::vector<std::string> prefix_ngram;
-                prefix_ngram = ext_scorer->make_ngram(prefix);
-                prefix_log_cond_prob = ext_scorer->get_log_cond_prob(prefix_ngram);
-                prefix_new_log_cond_prob = log_sum_exp(prefix_new_log_cond_prob, prefix_log_cond_prob);
-              }
-              score = prefix_new_log_cond_prob * ext_scorer->alpha;
-              log_p += score;
-              log_p += ext_scorer->beta;
-            }
-          }   // end of LM scoring
-          
-          prefix_new->log_prob_nb_cur =
-              log_sum_exp(prefix_new->log_prob_nb_cur, log_p);
-        }
-      }  // end of loop over prefix
-    }    // end of loop over vocabulary
-
-    prefixes.clear();
-    // update log probs
-    root.iterate_to_vec(prefixes);
-
-    // only preserve top beam_size prefixes
-    if (prefixes.size() >= beam_size) {
-      std::nth_element(prefixes.begin(),
-                       prefixes.begin() + beam_size,
-                       prefixes.end(),
+          if (stats != nullptr) {
+            ++stats->num_candidates;
+          }
+          // blank
+          if (c == blank_id_) {
+            prefix->log_prob_b_cur =
+                log_sum_exp(prefix->log_prob_b_cur, log_prob_c + prefix->score);
+            continue;
+          }
+          // repeated character
+          if (c == prefix->character) {
+            prefix->log_prob_nb_cur = log_sum_exp(
+                prefix->log_prob_nb_cur, log_prob_c + prefix->log_prob_nb_prev);
+          }
+          // get new prefix
+          auto prefix_new = extend(prefix, c, stats);
+
+          if (prefix_new != nullptr) {
+            float log_p = extension_log_prob(prefix, prefix_new, c, log_prob_c, stats);
+            prefix_new->log_prob_nb_cur =
+                log_sum_exp(prefix_new->log_prob_nb_cur, log_p);
+          }
+        }  // end of loop over prefix
+      }    // end of loop over vocabulary
+    }
+    if (stats != nullptr) {
+      stats->expansion_ms += lap_ms(&start);
+      stats->peak_live_nodes = std::max<uint64_t>(stats->peak_live_nodes, arena_.num_live());
+    }
+
+    // update log probs of the surviving prefixes and of the ones activated
+    // by this time step, instead of walking the whole trie
+    prefixes_.insert(prefixes_.end(), active_.begin(), active_.end());
+    active_.clear();
+    for (auto prefix : prefixes_) {
+      prefix->update_log_probs();
+    }
+
+    // drop the prefixes more than beam_threshold_ below the best one
+    if (beam_threshold_ > 0.0) {
+      float best_score = -NUM_FLT_INF;
+      for (auto prefix : prefixes_) {
+        best_score = std::max(best_score, prefix->score);
+      }
+      float threshold_cutoff = best_score - static_cast<float>(beam_threshold_);
+      auto end = std::partition(prefixes_.begin(), prefixes_.end(),
+                                [threshold_cutoff](const PathTrie *prefix) {
+                                  return prefix->score >= threshold_cutoff;
+                                });
+      for (auto it = end; it != prefixes_.end(); ++it) {
+        (*it)->remove();
+      }
+      prefixes_.erase(end, prefixes_.end());
+    }
+
+    // only preserve top beam_size prefixes_
+    if (prefixes_.size() >= beam_size) {
+      std::nth_element(prefixes_.begin(),
+                       prefixes_.begin() + beam_size,
+                       prefixes_.end(),
                        prefix_compare);
-      for(size_t i = beam_size; i < prefixes.size(); i++){
-        prefixes[i]->remove();
+      for(size_t i = beam_size; i < prefixes_.size(); i++){
+        prefixes_[i]->remove();
       }
+      prefixes_.resize(beam_size);
+    }
+    ++abs_time_step_;
+    if (stats != nullptr) {
+      stats->selection_ms += lap_ms(&start);
     }
   }  // end of loop over time
+}
+
+PathTrie *DecoderState::extend(PathTrie *prefix, size_t c, DecoderStats *stats) {
+  bool ignore_tokenization_symbol = (ext_scorer_ != nullptr && (ext_scorer_->tokenization_char_map_.find(c) !=
+                                                              ext_scorer_->tokenization_char_map_.end()));
+  if (stats == nullptr) {
+    return prefix->get_path_trie(c, abs_time_step_, ignore_tokenization_symbol);
+  }
+  size_t num_live = arena_.num_live();
+  auto prefix_new = prefix->get_path_trie(c, abs_time_step_, ignore_tokenization_symbol);
+  if (prefix_new == nullptr) {
+    ++stats->num_dictionary_rejections;
+  } else if (arena_.num_live() > num_live) {
+    ++stats->num_trie_new_nodes;
+  } else {
+    ++stats->num_trie_hits;
+  }
+  return prefix_new;
+}
+
+float DecoderState::lm_log_cond_prob(PathTrie *prefix, DecoderStats *stats) {
+  if (stats == nullptr) {
+    return ext_scorer_->get_log_cond_prob(prefix);
+  }
+  StatsClock::time_point start = StatsClock::now();
+  float log_cond_prob = ext_scorer_->get_log_cond_prob(prefix, stats);
+  stats->lm_ms += lap_ms(&start);
+  return log_cond_prob;
+}
+
+float DecoderState::extension_log_prob(PathTrie *prefix,
+                                       PathTrie *prefix_new,
+                                       size_t c,
+                                       float log_prob_c,
+                                       DecoderStats *stats) {
+  float log_p = -NUM_FLT_INF;
+
+  if (c == prefix->character &&
+      prefix->log_prob_b_prev > -NUM_FLT_INF) {
+    log_p = log_prob_c + prefix->log_prob_b_prev;
+  } else if (c != prefix->character) {
+    log_p = log_prob_c + prefix->score;
+  }
+  // language model scoring
+  if (ext_scorer_ != nullptr &&
+      (ext_scorer_->tokenization_char_map_.find(c) != ext_scorer_->tokenization_char_map_.end() ||
+       ext_scorer_->is_character_based())) {
+    // the weights in float, as the rest of the scores
+    float alpha = static_cast<float>(ext_scorer_->alpha);
+    float beta = static_cast<float>(ext_scorer_->beta);
+    // character based
+    if (ext_scorer_->is_character_based()){
+      float score = lm_log_cond_prob(prefix_new, stats) * alpha;
+      log_p += score;
+      log_p += beta;
+    }
+    else{ // word based
+      /*
+      Algorithm:
+      If current is tokenization symbol:
+         1 prefix_new_score = ngram_score(prefix_new)
+         2 if prefix->character is not tokenization character
+                 prefix_score = ngram_score(prefix)
+             else
+                 prefix_score <- 0.0
+         3 score = prefix_new_score + prefix_score (log scale sum)
+      The n-gram scores are cached on the trie nodes, see
+      Scorer::get_log_cond_prob(PathTrie *).
+      */
+      float score;
+      float prefix_new_log_cond_prob = lm_log_cond_prob(prefix_new, stats);
+
+      if(ext_scorer_->tokenization_char_map_.find(prefix->character) == ext_scorer_->tokenization_char_map_.end()){
+        float prefix_log_cond_prob = lm_log_cond_prob(prefix, stats);
+        prefix_new_log_cond_prob = log_sum_exp(prefix_new_log_cond_prob, prefix_log_cond_prob);
+      }
+      score = prefix_new_log_cond_prob * alpha;
+      log_p += score;
+      log_p += beta;
+    }
+  }   // end of LM scoring
+  return log_p;
+}
+
+void DecoderState::expand_parallel(
+    const std::vector<std::pair<size_t, float>> &log_prob_idx,
+    float min_cutoff,
+    bool apply_cutoff) {
+  size_t num_prefixes = std::min(prefixes_.size(), beam_size_);
+  DecoderStats *stats = collect_stats_ ? &stats_ : nullptr;
+
+  // 1. serially: blank and repeated character updates, and the trie nodes
+  // of the extensions. No two extensions share a node. The prefixes whose
+  // extensions get an lm score are scored here, so that the workers only
+  // read the lm state of the histories.
+  extensions_.clear();
+  for (size_t index = 0; index < log_prob_idx.size(); index++) {
+    auto c = log_prob_idx[index].first;
+    auto log_prob_c = log_prob_idx[index].second;
+
+    for (size_t i = 0; i < num_prefixes; ++i) {
+      auto prefix = prefixes_[i];
+
+      if (apply_cutoff && log_prob_c + prefix->score < min_cutoff) {
+        break;
+      }
+      if (stats != nullptr) {
+        ++stats->num_candidates;
+      }
+      // blank
+      if (c == blank_id_) {
+        prefix->log_prob_b_cur =
+            log_sum_exp(prefix->log_prob_b_cur, log_prob_c + prefix->score);
+        continue;
+      }
+      // repeated character
+      if (c == prefix->character) {
+        prefix->log_prob_nb_cur = log_sum_exp(
+            prefix->log_prob_nb_cur, log_prob_c + prefix->log_prob_nb_prev);
+      }
+      // get new prefix
+      auto prefix_new = extend(prefix, c, stats);
+      if (prefix_new == nullptr) {
+        continue;
+      }
+      if (!prefix->lm_scored &&
+          (ext_scorer_->tokenization_char_map_.find(c) != ext_scorer_->tokenization_char_map_.end() ||
+           ext_scorer_->is_character_based())) {
+        // the serial expansion scores the same prefixes, as the history of
+        // prefix_new, so only its lm requests are counted, by the workers
+        DecoderStats history_stats;
+        lm_log_cond_prob(prefix, stats != nullptr ? &history_stats : nullptr);
+        if (stats != nullptr) {
+          history_stats.num_lm_requests = 0;
+          stats->merge(history_stats);
+        }
+      }
+      extensions_.push_back({prefix, prefix_new, c, log_prob_c, 0.0f});
+    }
+  }
+
+  // 2. in parallel: the log probabilities of the extensions, with their lm
+  // scores, over contiguous partitions. Each task counts into its own stats.
+  size_t num_tasks = std::min(num_expansion_tasks_,
+                              std::max<size_t>(extensions_.size() / kMinExtensionsPerTask, 1));
+  std::vector<DecoderStats> task_stats(stats != nullptr ? num_tasks : 0);
+  auto score_range = [this, &task_stats](size_t t, size_t begin, size_t end) {
+    DecoderStats *stats = task_stats.empty() ? nullptr : &task_stats[t];
+    for (size_t j = begin; j < end; ++j) {
+      Extension &ext = extensions_[j];
+      ext.log_p = extension_log_prob(ext.prefix, ext.prefix_new, ext.c, ext.log_prob_c, stats);
+    }
+  };
+  size_t task_size = (extensions_.size() + num_tasks - 1) / num_tasks;
+  std::vector<std::future<void>> res;
+  for (size_t t = 1; t < num_tasks; ++t) {
+    size_t begin = std::min(t * task_size, extensions_.size());
+    size_t end = std::min(begin + task_size, extensions_.size());
+    res.emplace_back(expansion_pool_->enqueue(score_range, t, begin, end));
+  }
+  // the calling thread takes the first partition
+  score_range(0, 0, std::min(task_size, extensions_.size()));
+  for (auto &r : res) {
+    r.get();
+  }
+  for (const DecoderStats &s : task_stats) {
+    stats->merge(s);
+  }
+
+  // 3. serially, in a fixed order: merge into the new prefixes. A node gets
+  // at most one extension and one repeated character term per time step,
+  // and log_sum_exp is symmetric, so the result doesn't depend on the order
+  // of the two and equals the one of the serial expansion
+  for (const Extension &ext : extensions_) {
+    ext.prefix_new->log_prob_nb_cur =
+        log_sum_exp(ext.prefix_new->log_prob_nb_cur, ext.log_p);
+  }
+}
+
+void DecoderState::set_expansion_pool(ThreadPool *pool, size_t num_tasks) {
+  // only the lm scoring of the extensions is split, without it the tasks
+  // cost more than they save
+  expansion_pool_ = num_tasks > 1 && ext_scorer_ != nullptr ? pool : nullptr;
+  num_expansion_tasks_ = num_tasks;
+}
+
+void DecoderState::skip_blank_frame(const ProbsView &probs, size_t time_step) {
+  auto log_prob = [&](size_t c) -> float {
+    float prob = probs.at(time_step, c);
+    return log_probs_input_ ? prob : std::log(prob + NUM_FLT_MIN);
+  };
+  float log_prob_blank = log_prob(blank_id_);
+
+  // the prefixes are only extended by blank or by repeating their last
+  // character, so the beam keeps the same prefixes and no pruning is needed
+  for (auto prefix : prefixes_) {
+    prefix->log_prob_b_cur =
+        log_sum_exp(prefix->log_prob_b_cur, log_prob_blank + prefix->score);
+    if (!prefix->is_empty()) {
+      prefix->log_prob_nb_cur =
+          log_sum_exp(prefix->log_prob_nb_cur,
+                      log_prob(prefix->character) + prefix->log_prob_nb_prev);
+    }
+  }
+  for (auto prefix : prefixes_) {
+    prefix->update_log_probs();
+  }
+  ++abs_time_step_;
+}
+
+std::vector<std::pair<double, Output>> DecoderState::get_partial() const {
+  return get_beam_search_result(prefixes_, beam_size_);
+}
+
+std::vector<std::pair<double, Output>> DecoderState::finalize() {
+  VALID_CHECK(!finalized_, "finalize() called twice on a decoder state");
+  finalized_ = true;
+  DecoderStats *stats = collect_stats_ ? &stats_ : nullptr;
+  StatsClock::time_point start;
+  if (stats != nullptr) {
+    start = StatsClock::now();
+  }
 
   // score the last word of each prefix that doesn't end with stop symbol
-  if (ext_scorer != nullptr && !ext_scorer->is_character_based()) {
-    for (size_t i = 0; i < beam_size && i < prefixes.size(); ++i) {
-      auto prefix = prefixes[i];
+  if (ext_scorer_ != nullptr && !ext_scorer_->is_character_based()) {
+    for (size_t i = 0; i < beam_size_ && i < prefixes_.size(); ++i) {
+      auto prefix = prefixes_[i];
       if (!prefix->is_empty() &&
-          ext_scorer->tokenization_char_map_.find(prefix->character) == ext_scorer->tokenization_char_map_.end()) {
+          ext_scorer_->tokenization_char_map_.find(prefix->character) == ext_scorer_->tokenization_char_map_.end()) {
         float score;
-        std::vector<std::string> ngram = ext_scorer->make_ngram(prefix);
-        score = ext_scorer->get_log_cond_prob(ngram) * ext_scorer->alpha;
-        score += ext_scorer->beta;
+        score = lm_log_cond_prob(prefix, stats) * ext_scorer_->alpha;
+        score += ext_scorer_->beta;
         prefix->score += score;
       }
     }
   }
 
-  size_t num_prefixes = std::min(prefixes.size(), beam_size);
-  std::sort(prefixes.begin(), prefixes.begin() + num_prefixes, prefix_compare);
+  size_t num_prefixes = std::min(prefixes_.size(), beam_size_);
+  std::sort(prefixes_.begin(), prefixes_.begin() + num_prefixes, prefix_compare);
 
   // compute aproximate ctc score as the return score, without affecting the
   // return order of decoding result. To delete when decoder gets stable.
-  for (size_t i = 0; i < beam_size && i < prefixes.size(); ++i) {
-    double approx_ctc = prefixes[i]->score;
-    if (ext_scorer != nullptr) {
+  for (size_t i = 0; i < beam_size_ && i < prefixes_.size(); ++i) {
+    double approx_ctc = prefixes_[i]->score;
+    if (ext_scorer_ != nullptr) {
       std::vector<int> output;
       std::vector<int> timesteps;
-      prefixes[i]->get_path_vec(output, timesteps);
+      prefixes_[i]->get_path_vec(output, timesteps);
       auto prefix_length = output.size();
-      auto words = ext_scorer->split_labels(output);
+      auto words = ext_scorer_->split_labels(output);
       // remove word insert
-      approx_ctc = approx_ctc - prefix_length * ext_scorer->beta;
+      approx_ctc = approx_ctc - prefix_length * ext_scorer_->beta;
       // remove language model weight:
-      approx_ctc -= (ext_scorer->get_sent_log_prob(words)) * ext_scorer->alpha;
+      approx_ctc -= (ext_scorer_->get_sent_log_prob(words)) * ext_scorer_->alpha;
     }
-    prefixes[i]->approx_ctc = approx_ctc;
+    prefixes_[i]->approx_ctc = approx_ctc;
+  }
+
+  auto result = get_beam_search_result(prefixes_, beam_size_);
+  if (stats != nullptr) {
+    stats->finalize_ms += lap_ms(&start);
   }
+  return result;
+}
+
 
-  return get_beam_search_result(prefixes, beam_size);
+std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
+    const ProbsView &probs,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    Scorer *ext_scorer,
+    bool log_probs_input,
+    double blank_skip_threshold,
+    double beam_threshold,
+    size_t min_beam_size,
+    size_t min_cutoff_top_n,
+    DecoderStats *stats) {
+  DecoderState state(vocabulary, beam_size, cutoff_prob, cutoff_top_n,
+                     blank_id, ext_scorer, log_probs_input,
+                     blank_skip_threshold, beam_threshold, min_beam_size,
+                     min_cutoff_top_n);
+  state.set_collect_stats(stats != nullptr);
+  state.next(probs);
+  auto result = state.finalize();
+  if (stats != nullptr) {
+    *stats = state.stats();
+  }
+  return result;
+}
+
+std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
+    const std::vector<std::vector<double>> &probs_seq,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    Scorer *ext_scorer,
+    bool log_probs_input,
+    double blank_skip_threshold,
+    double beam_threshold,
+    size_t min_beam_size,
+    size_t min_cutoff_top_n,
+    DecoderStats *stats) {
+  std::vector<float> buffer;
+  return ctc_beam_search_decoder(make_probs_view(probs_seq, &buffer),
+                                 vocabulary,
+                                 beam_size,
+                                 cutoff_prob,
+                                 cutoff_top_n,
+                                 blank_id,
+                                 ext_scorer,
+                                 log_probs_input,
+                                 blank_skip_threshold,
+                                 beam_threshold,
+                                 min_beam_size,
+                                 min_cutoff_top_n,
+                                 stats);
 }
 
 
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch(
+    const std::vector<ProbsView> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    double cutoff_prob,
+    size_t cutoff_top_n,
+    size_t blank_id,
+    Scorer *ext_scorer,
+    bool log_probs_input,
+    double blank_skip_threshold,
+    double beam_threshold,
+    size_t min_beam_size,
+    size_t min_cutoff_top_n,
+    double batch_time_budget_ms,
+    double utterance_time_budget_ms,
+    std::vector<DecoderStats> *stats,
+    std::vector<bool> *degraded) {
+  Decoder decoder(vocabulary,
+                  beam_size,
+                  num_processes,
+                  cutoff_prob,
+                  cutoff_top_n,
+                  blank_id,
+                  ext_scorer,
+                  log_probs_input,
+                  blank_skip_threshold,
+                  beam_threshold,
+                  min_beam_size,
+                  min_cutoff_top_n);
+  return decoder.decode(probs_split, stats, batch_time_budget_ms,
+                        utterance_time_budget_ms, degraded);
+}
+
 std::vector<std::vector<std::pair<double, Output>>>
 ctc_beam_search_decoder_batch(
     const std::vector<std::vector<std::vector<double>>> &probs_split,
@@ -214,8 +683,59 @@ ctc_beam_search_decoder_batch(
     double cutoff_prob,
     size_t cutoff_top_n,
     size_t blank_id,
-    Scorer *ext_scorer) {
+    Scorer *ext_scorer,
+    bool log_probs_input,
+    double blank_skip_threshold,
+    double beam_threshold,
+    size_t min_beam_size,
+    size_t min_cutoff_top_n,
+    double batch_time_budget_ms,
+    double utterance_time_budget_ms,
+    std::vector<DecoderStats> *stats,
+    std::vector<bool> *degraded) {
+  std::vector<std::vector<float>> buffers(probs_split.size());
+  std::vector<ProbsView> views;
+  for (size_t i = 0; i < probs_split.size(); ++i) {
+    views.push_back(make_probs_view(probs_split[i], &buffers[i]));
+  }
+  return ctc_beam_search_decoder_batch(views,
+                                       vocabulary,
+                                       beam_size,
+                                       num_processes,
+                                       cutoff_prob,
+                                       cutoff_top_n,
+                                       blank_id,
+                                       ext_scorer,
+                                       log_probs_input,
+                                       blank_skip_threshold,
+                                       beam_threshold,
+                                       min_beam_size,
+                                       min_cutoff_top_n,
+                                       batch_time_budget_ms,
+                                       utterance_time_budget_ms,
+                                       stats,
+                                       degraded);
+}
+
+static std::vector<std::pair<double, Output>> decode_with_given_state(
+    const ProbsView &probs,
+    DecoderState *state,
+    bool is_eos) {
+  state->next(probs);
+  return is_eos ? state->finalize() : state->get_partial();
+}
+
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_with_given_state_batch(
+    const std::vector<ProbsView> &probs_split,
+    size_t num_processes,
+    const std::vector<DecoderState *> &states,
+    const std::vector<bool> &is_eos_s) {
   VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  VALID_CHECK_EQ(probs_split.size(), states.size(),
+                 "The number of states does not match with the batch size");
+  VALID_CHECK_EQ(probs_split.size(), is_eos_s.size(),
+                 "The number of eos flags does not match with the batch size");
   // thread pool
   ThreadPool pool(num_processes);
   // number of samples
@@ -224,14 +744,10 @@ ctc_beam_search_decoder_batch(
   // enqueue the tasks of decoding
   std::vector<std::future<std::vector<std::pair<double, Output>>>> res;
   for (size_t i = 0; i < batch_size; ++i) {
-    res.emplace_back(pool.enqueue(ctc_beam_search_decoder,
+    res.emplace_back(pool.enqueue(decode_with_given_state,
                                   probs_split[i],
-                                  vocabulary,
-                                  beam_size,
-                                  cutoff_prob,
-                                  cutoff_top_n,
-                                  blank_id,
-                                  ext_scorer));
+                                  states[i],
+                                  is_eos_s[i]));
   }
 
   // get decoding results
@@ -1,19 +1,27 @@
 #ifndef CTC_BEAM_SEARCH_DECODER_H_
 #define CTC_BEAM_SEARCH_DECODER_H_
 
+#include <chrono>
 #include <string>
 #include <utility>
 #include <vector>
 #include <map>
+#include <memory>
 
+#include "decoder_stats.h"
+#include "fst/fstlib.h"
 #include "scorer.h"
 #include "output.h"
+#include "path_trie.h"
+#include "probs_view.h"
+
+class ThreadPool;
 
 /* CTC Beam Search Decoder
 
  * Parameters:
- *     probs_seq: 2-D vector that each element is a vector of probabilities
- *               over vocabulary of one time step.
+ *     probs: View of the probabilities over vocabulary of each time step,
+ *            read in place.
  *     vocabulary: A vector of vocabulary.
  *     beam_size: The width of beam search.
  *     cutoff_prob: Cutoff probability for pruning.
@@ -21,11 +29,46 @@
  *     ext_scorer: External scorer to evaluate a prefix, which consists of
  *                 n-gram language model scoring and word insertion term.
  *                 Default null, decoding the input sample without scorer.
+ *     log_probs_input: Whether the inputs are log probabilities, e.g. the
+ *                      output of log_softmax, rather than probabilities.
+ *     blank_skip_threshold: Time steps whose blank probability is at least
+ *                           this value only extend the current prefixes,
+ *                           without expanding new ones. Default 1.0,
+ *                           disabled.
+ *     beam_threshold: Log probability margin below the best prefix beyond
+ *                     which expansions and prefixes are dropped, on top of
+ *                     beam_size. Default 0.0, disabled.
+ *     min_beam_size: Adaptive beam: if not 0, the beam width of each time
+ *                    step grows with the entropy of its candidates, from
+ *                    min_beam_size for a confident time step to beam_size
+ *                    for a uniform one. Default 0, disabled.
+ *     min_cutoff_top_n: The same for the number of candidates of each time
+ *                       step, up to the number without it: every class,
+ *                       or cutoff_top_n if cutoff_prob is below 1.0.
+ *                       Default 0, disabled.
+ *     stats: Set to the performance counters of the decoding, if not null.
  * Return:
  *     A vector that each element is a pair of score  and decoding result,
  *     in desending order.
 */
 
+std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
+    const ProbsView &probs,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40,
+    size_t blank_id = 0,
+    Scorer *ext_scorer = nullptr,
+    bool log_probs_input = false,
+    double blank_skip_threshold = 1.0,
+    double beam_threshold = 0.0,
+    size_t min_beam_size = 0,
+    size_t min_cutoff_top_n = 0,
+    DecoderStats *stats = nullptr);
+
+// Same as above, for a 2-D vector that each element is a vector of
+// probabilities over vocabulary of one time step.
 std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
     const std::vector<std::vector<double>> &probs_seq,
     const std::vector<std::string> &vocabulary,
@@ -33,13 +76,19 @@ std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
     double cutoff_prob = 1.0,
     size_t cutoff_top_n = 40,
     size_t blank_id = 0,
-    Scorer *ext_scorer = nullptr);
+    Scorer *ext_scorer = nullptr,
+    bool log_probs_input = false,
+    double blank_skip_threshold = 1.0,
+    double beam_threshold = 0.0,
+    size_t min_beam_size = 0,
+    size_t min_cutoff_top_n = 0,
+    DecoderStats *stats = nullptr);
 
 /* CTC Beam Search Decoder for batch data
 
  * Parameters:
- *     probs_seq: 3-D vector that each element is a 2-D vector that can be used
- *                by ctc_beam_search_decoder().
+ *     probs_split: View of the probabilities of each audio sample, that can
+ *                  be used by ctc_beam_search_decoder().
  *     vocabulary: A vector of vocabulary.
  *     beam_size: The width of beam search.
  *     num_processes: Number of threads for beam search.
@@ -48,11 +97,60 @@ std::vector<std::pair<double, Output>> ctc_beam_search_decoder(
  *     ext_scorer: External scorer to evaluate a prefix, which consists of
  *                 n-gram language model scoring and word insertion term.
  *                 Default null, decoding the input sample without scorer.
+ *     log_probs_input: Whether the inputs are log probabilities, e.g. the
+ *                      output of log_softmax, rather than probabilities.
+ *     blank_skip_threshold: Time steps whose blank probability is at least
+ *                           this value only extend the current prefixes,
+ *                           without expanding new ones. Default 1.0,
+ *                           disabled.
+ *     beam_threshold: Log probability margin below the best prefix beyond
+ *                     which expansions and prefixes are dropped, on top of
+ *                     beam_size. Default 0.0, disabled.
+ *     min_beam_size: Adaptive beam: if not 0, the beam width of each time
+ *                    step grows with the entropy of its candidates, from
+ *                    min_beam_size for a confident time step to beam_size
+ *                    for a uniform one. Default 0, disabled.
+ *     min_cutoff_top_n: The same for the number of candidates of each time
+ *                       step, up to the number without it: every class,
+ *                       or cutoff_top_n if cutoff_prob is below 1.0.
+ *                       Default 0, disabled.
+ *     batch_time_budget_ms: Time from the call by which the whole batch is
+ *                           to be decoded, see DecoderState::set_deadline.
+ *                           Default 0.0, no deadline.
+ *     utterance_time_budget_ms: Time from the start of the decoding of each
+ *                               audio sample by which it is to be decoded.
+ *                               Default 0.0, no deadline.
+ *     stats: Set to the performance counters of each audio sample, if not
+ *            null.
+ *     degraded: Set to whether the beam of each audio sample was narrowed
+ *               to meet a deadline, if not null.
  * Return:
  *     A 2-D vector that each element is a vector of beam search decoding
  *     result for one audio sample.
 */
 std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_batch(
+    const std::vector<ProbsView> &probs_split,
+    const std::vector<std::string> &vocabulary,
+    size_t beam_size,
+    size_t num_processes,
+    double cutoff_prob = 1.0,
+    size_t cutoff_top_n = 40,
+    size_t blank_id = 0,
+    Scorer *ext_scorer = nullptr,
+    bool log_probs_input = false,
+    double blank_skip_threshold = 1.0,
+    double beam_threshold = 0.0,
+    size_t min_beam_size = 0,
+    size_t min_cutoff_top_n = 0,
+    double batch_time_budget_ms = 0.0,
+    double utterance_time_budget_ms = 0.0,
+    std::vector<DecoderStats> *stats = nullptr,
+    std::vector<bool> *degraded = nullptr);
+
+// Same as above, for a 3-D vector that each element is a 2-D vector of the
+// probabilities of one audio sample.
+std::vector<std::vector<std::pair<double, Output>>>
 ctc_beam_search_decoder_batch(
     const std::vector<std::vector<std::vector<double>>> &probs_split,
     const std::vector<std::string> &vocabulary,
@@ -61,6 +159,226 @@ ctc_beam_search_decoder_batch(
     double cutoff_prob = 1.0,
     size_t cutoff_top_n = 40,
     size_t blank_id = 0,
-    Scorer *ext_scorer = nullptr);
+    Scorer *ext_scorer = nullptr,
+    bool log_probs_input = false,
+    double blank_skip_threshold = 1.0,
+    double beam_threshold = 0.0,
+    size_t min_beam_size = 0,
+    size_t min_cutoff_top_n = 0,
+    double batch_time_budget_ms = 0.0,
+    double utterance_time_budget_ms = 0.0,
+    std::vector<DecoderStats> *stats = nullptr,
+    std::vector<bool> *degraded = nullptr);
+
+/* Decoder state for streaming CTC beam search
+
+ * Owns the prefix trie and the current beam of one utterance, so that
+ * frames can be fed chunk by chunk as they arrive. The cost of each call to
+ * next() is proportional to the chunk length only.
+ *
+ * Parameters:
+ *     vocabulary: A vector of vocabulary.
+ *     beam_size: The width of beam search.
+ *     cutoff_prob: Cutoff probability for pruning.
+ *     cutoff_top_n: Cutoff number for pruning.
+ *     blank_id: Index of the CTC blank label.
+ *     ext_scorer: External scorer to evaluate a prefix, which consists of
+ *                 n-gram language model scoring and word insertion term.
+ *                 Default null, decoding the input sample without scorer.
+ *     log_probs_input: Whether the inputs are log probabilities, e.g. the
+ *                      output of log_softmax, rather than probabilities.
+ *     blank_skip_threshold: Time steps whose blank probability is at least
+ *                           this value only extend the current prefixes,
+ *                           without expanding new ones. Default 1.0,
+ *                           disabled.
+ *     beam_threshold: Log probability margin below the best prefix beyond
+ *                     which expansions and prefixes are dropped, on top of
+ *                     beam_size. Default 0.0, disabled.
+ *     min_beam_size: Adaptive beam: if not 0, the beam width of each time
+ *                    step grows with the entropy of its candidates, from
+ *                    min_beam_size for a confident time step to beam_size
+ *                    for a uniform one. Default 0, disabled.
+ *     min_cutoff_top_n: The same for the number of candidates of each time
+ *                       step, up to the number without it: every class,
+ *                       or cutoff_top_n if cutoff_prob is below 1.0.
+ *                       Default 0, disabled.
+ *
+ * Example:
+ *     DecoderState state(vocabulary, beam_size);
+ *     state.next(chunk_1);
+ *     state.get_partial();  // intermediate hypotheses
+ *     state.next(chunk_2);
+ *     state.finalize();     // final hypotheses, last word scored by the lm
+*/
+class DecoderState {
+public:
+  DecoderState(const std::vector<std::string> &vocabulary,
+               size_t beam_size,
+               double cutoff_prob = 1.0,
+               size_t cutoff_top_n = 40,
+               size_t blank_id = 0,
+               Scorer *ext_scorer = nullptr,
+               bool log_probs_input = false,
+               double blank_skip_threshold = 1.0,
+               double beam_threshold = 0.0,
+               size_t min_beam_size = 0,
+               size_t min_cutoff_top_n = 0);
+
+  // the prefixes point into the trie owned by the state
+  DecoderState(const DecoderState &) = delete;
+  DecoderState &operator=(const DecoderState &) = delete;
+
+  // advance the beam search over a chunk of time steps
+  void next(const ProbsView &probs);
+
+  void next(const std::vector<std::vector<double>> &probs_seq);
+
+  // return the current beam without finalizing the state
+  std::vector<std::pair<double, Output>> get_partial() const;
+
+  // score the last word of each prefix and return the final beam, no more
+  // time steps can be fed afterwards
+  std::vector<std::pair<double, Output>> finalize();
+
+  // number of time steps decoded so far
+  size_t num_time_steps() const { return abs_time_step_; }
+
+  bool is_finalized() const { return finalized_; }
+
+  // split the expansion of each time step into up to num_tasks partitions,
+  // all but one of them run on pool, which must outlive the state. The
+  // result is the same as the one of the serial expansion. A null pool,
+  // num_tasks <= 1 or no ext_scorer expands serially, the default.
+  void set_expansion_pool(ThreadPool *pool, size_t num_tasks);
+
+  // count the work and time the stages of the decoding in stats(), off by
+  // default
+  void set_collect_stats(bool collect_stats) { collect_stats_ = collect_stats; }
+
+  const DecoderStats &stats() const { return stats_; }
+
+  // Finish the time steps of the following next() calls by deadline. Each
+  // time step checks whether the remaining ones, at the mean time per step
+  // since the beam last changed, would overrun it, and if so halves the
+  // beam width and the number of candidates. Past the deadline, the
+  // remaining time steps extend the best prefix with the best candidate
+  // only, i.e. the best path. Setting a deadline restores the full beam.
+  void set_deadline(std::chrono::steady_clock::time_point deadline);
+
+  // whether any time step was decoded with a beam narrowed by a deadline
+  bool degraded() const { return degraded_; }
+
+private:
+  // prefix_new extending prefix with character c, whose log probability is
+  // computed by a worker during a parallel expansion
+  struct Extension {
+    PathTrie *prefix;
+    PathTrie *prefix_new;
+    size_t c;
+    float log_prob_c;
+    float log_p;
+  };
+
+  // don't split fewer extensions than this per task
+  static const size_t kMinExtensionsPerTask = 64;
+
+  // time steps timed before the beam is narrowed for a deadline
+  static const size_t kDeadlineWindow = 8;
+
+  // apply a blank dominated time step to the current prefixes
+  void skip_blank_frame(const ProbsView &probs, size_t time_step);
+
+  // trie node of prefix extended with c, nullptr if the dictionary rejects
+  // it
+  PathTrie *extend(PathTrie *prefix, size_t c, DecoderStats *stats);
+
+  // log probability of extending prefix with c into prefix_new, including
+  // the language model score. The lm work is counted in stats, if not null.
+  float extension_log_prob(PathTrie *prefix,
+                           PathTrie *prefix_new,
+                           size_t c,
+                           float log_prob_c,
+                           DecoderStats *stats);
+
+  // lm score of the last token of prefix, timed in stats if not null
+  float lm_log_cond_prob(PathTrie *prefix, DecoderStats *stats);
+
+  // narrow the beam if the time steps of next() from time_step on would
+  // overrun the deadline
+  void keep_deadline(size_t time_step, size_t num_time_steps);
+
+  // expand the current prefixes by the candidates of one time step, the
+  // language model scoring split over the expansion pool
+  void expand_parallel(const std::vector<std::pair<size_t, float>> &log_prob_idx,
+                       float min_cutoff,
+                       bool apply_cutoff);
+
+  // only the size of the vocabulary is needed, the labels are not copied
+  // for each utterance
+  size_t vocab_size_;
+  size_t beam_size_;
+  double cutoff_prob_;
+  size_t cutoff_top_n_;
+  size_t blank_id_;
+  Scorer *ext_scorer_;
+  bool log_probs_input_;
+  double blank_skip_threshold_;
+  double beam_threshold_;
+  size_t min_beam_size_;
+  size_t min_cutoff_top_n_;
+  // candidates of a time step before the adaptive beam and the deadline
+  // narrow them: every class, unless cutoff_prob prunes them to
+  // cutoff_top_n, see get_pruned_log_probs()
+  size_t max_top_n_;
+
+  size_t abs_time_step_;
+  bool finalized_;
+  bool collect_stats_;
+  DecoderStats stats_;
+
+  // deadline of next(), beam width and number of candidates it allows, and
+  // the time steps timed since they last changed
+  bool has_deadline_;
+  std::chrono::steady_clock::time_point deadline_;
+  std::chrono::steady_clock::time_point deadline_window_start_;
+  size_t deadline_window_steps_;
+  size_t deadline_beam_size_;
+  size_t deadline_cutoff_top_n_;
+  bool degraded_;
+
+  // storage of every trie node below the root, released with the state
+  PathTrieArena arena_;
+  // live hypotheses, at most beam_size of them between time steps
+  std::vector<PathTrie *> prefixes_;
+  // prefixes created or revived during the current time step
+  std::vector<PathTrie *> active_;
+  // pruned log probabilities of the current time step
+  std::vector<std::pair<size_t, float>> log_prob_idx_;
+  // workers and pending extensions of the parallel expansion
+  ThreadPool *expansion_pool_;
+  size_t num_expansion_tasks_;
+  std::vector<Extension> extensions_;
+  PathTrie root_;
+};
+
+/* Streaming CTC Beam Search Decoder for batch data
+
+ * Parameters:
+ *     probs_split: View of the next chunk of time steps of each audio
+ *                  sample.
+ *     num_processes: Number of threads for beam search.
+ *     states: Decoder state of each audio sample, advanced in place.
+ *     is_eos_s: Whether the chunk is the last one of each audio sample, in
+ *               which case its state is finalized.
+ * Return:
+ *     A 2-D vector that each element is a vector of beam search decoding
+ *     result for one audio sample, partial unless the state was finalized.
+*/
+std::vector<std::vector<std::pair<double, Output>>>
+ctc_beam_search_decoder_with_given_state_batch(
+    const std::vector<ProbsView> &probs_split,
+    size_t num_processes,
+    const std::vector<DecoderState *> &states,
+    const std::vector<bool> &is_eos_s);
 
 #endif  // CTC_BEAM_SEARCH_DECODER_H_
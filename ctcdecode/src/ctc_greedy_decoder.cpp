@@ -0,0 +1,86 @@
+#include "ctc_greedy_decoder.h"
+
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// index of the first largest of the n values of row, stride apart
+static size_t argmax(const float *row, size_t n, std::ptrdiff_t stride) {
+  size_t best = 0;
+  size_t i = 1;
+#ifdef __SSE2__
+  if (stride == 1 && n >= 8) {
+    // four running maxima and their first index, one per lane
+    __m128 max = _mm_loadu_ps(row);
+    __m128i max_idx = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i idx = max_idx;
+    const __m128i four = _mm_set1_epi32(4);
+    for (i = 4; i + 4 <= n; i += 4) {
+      idx = _mm_add_epi32(idx, four);
+      __m128 v = _mm_loadu_ps(row + i);
+      __m128 gt = _mm_cmpgt_ps(v, max);
+      __m128i gt_mask = _mm_castps_si128(gt);
+      max = _mm_or_ps(_mm_and_ps(gt, v), _mm_andnot_ps(gt, max));
+      max_idx = _mm_or_si128(_mm_and_si128(gt_mask, idx),
+                             _mm_andnot_si128(gt_mask, max_idx));
+    }
+    float lane_max[4];
+    int lane_idx[4];
+    _mm_storeu_ps(lane_max, max);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lane_idx), max_idx);
+    // the lowest index among the equal maxima, as the scalar loop
+    best = lane_idx[0];
+    for (int l = 1; l < 4; ++l) {
+      if (lane_max[l] > row[best] ||
+          (lane_max[l] == row[best] && static_cast<size_t>(lane_idx[l]) < best)) {
+        best = lane_idx[l];
+      }
+    }
+  }
+#endif
+  // the tail of the vectorized loop, or the whole row
+  for (; i < n; ++i) {
+    if (row[i * stride] > row[best * stride]) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+std::pair<double, Output> ctc_greedy_decoder(const ProbsView &probs,
+                                             size_t blank_id,
+                                             bool log_probs_input) {
+  Output output;
+  // log probability of the best path. The probabilities are multiplied and
+  // only their product is logged when it gets small, rather than logging
+  // each of them
+  double log_prob = 0.0;
+  double prob = 1.0;
+  size_t prev = blank_id;
+  for (size_t t = 0; t < probs.num_time_steps; ++t) {
+    const float *row = probs.data + t * probs.time_stride;
+    size_t c = argmax(row, probs.num_classes, probs.class_stride);
+    float best = row[c * probs.class_stride];
+    if (log_probs_input) {
+      log_prob += best;
+    } else {
+      prob *= best;
+      if (prob < 1e-200) {
+        log_prob += std::log(prob);
+        prob = 1.0;
+      }
+    }
+    // a new token is a non blank class other than the previous one
+    if (c != blank_id && c != prev) {
+      output.tokens.push_back(c);
+      output.timesteps.push_back(t);
+    }
+    prev = c;
+  }
+  if (!log_probs_input) {
+    log_prob += std::log(prob);
+  }
+  return std::make_pair(-log_prob, output);
+}
@@ -0,0 +1,30 @@
+#ifndef CTC_GREEDY_DECODER_H_
+#define CTC_GREEDY_DECODER_H_
+
+#include <utility>
+#include <vector>
+
+#include "output.h"
+#include "probs_view.h"
+
+/* CTC Greedy (Best Path) Decoder
+
+ * Takes the most probable class of each time step, then merges the repeated
+ * classes and removes the blanks. No trie, pruning or scorer is involved, so
+ * it costs one pass over the probabilities.
+ *
+ * Parameters:
+ *     probs: View of the probabilities over vocabulary of each time step,
+ *            read in place.
+ *     blank_id: Index of the CTC blank label.
+ *     log_probs_input: Whether the inputs are log probabilities, e.g. the
+ *                      output of log_softmax, rather than probabilities.
+ * Return:
+ *     A pair of score and decoding result, the score being the negative log
+ *     probability of the best path, as the scores of the beam search.
+*/
+std::pair<double, Output> ctc_greedy_decoder(const ProbsView &probs,
+                                             size_t blank_id = 0,
+                                             bool log_probs_input = false);
+
+#endif  // CTC_GREEDY_DECODER_H_
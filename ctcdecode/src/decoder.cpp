@@ -0,0 +1,202 @@
+#include "decoder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <numeric>
+
+#include "ThreadPool.h"
+#include "ctc_greedy_decoder.h"
+#include "decoder_utils.h"
+
+Decoder::Decoder(const std::vector<std::string> &vocabulary,
+                 size_t beam_size,
+                 size_t num_processes,
+                 double cutoff_prob,
+                 size_t cutoff_top_n,
+                 size_t blank_id,
+                 Scorer *ext_scorer,
+                 bool log_probs_input,
+                 double blank_skip_threshold,
+                 double beam_threshold,
+                 size_t min_beam_size,
+                 size_t min_cutoff_top_n,
+                 size_t num_expansion_threads)
+    : vocabulary_(vocabulary),
+      beam_size_(beam_size),
+      cutoff_prob_(cutoff_prob),
+      cutoff_top_n_(cutoff_top_n),
+      blank_id_(blank_id),
+      ext_scorer_(ext_scorer),
+      log_probs_input_(log_probs_input),
+      blank_skip_threshold_(blank_skip_threshold),
+      beam_threshold_(beam_threshold),
+      min_beam_size_(min_beam_size),
+      min_cutoff_top_n_(min_cutoff_top_n),
+      num_expansion_threads_(num_expansion_threads) {
+  VALID_CHECK_GT(num_processes, 0, "num_processes must be nonnegative!");
+  pool_.reset(new ThreadPool(num_processes));
+  // a separate pool, the utterance workers block on the expansion tasks.
+  // Only the lm scoring is split, see DecoderState::set_expansion_pool
+  if (num_expansion_threads > 0 && ext_scorer != nullptr) {
+    expansion_pool_.reset(new ThreadPool(num_expansion_threads));
+  }
+}
+
+// out of line, where ThreadPool is complete; joins the workers
+Decoder::~Decoder() {}
+
+// Order in which the samples of a batch are queued: longest first, so that
+// a long utterance doesn't start last and keep one worker busy while the
+// others are idle. Idle workers take the next queued sample, so the short
+// ones fill in around the long ones.
+static std::vector<size_t> longest_first(
+    const std::vector<ProbsView> &probs_split) {
+  std::vector<size_t> order(probs_split.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return probs_split[a].num_time_steps > probs_split[b].num_time_steps;
+  });
+  return order;
+}
+
+// time point budget_ms after start
+static std::chrono::steady_clock::time_point after(
+    std::chrono::steady_clock::time_point start, double budget_ms) {
+  return start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                     std::chrono::duration<double, std::milli>(budget_ms));
+}
+
+std::vector<std::vector<std::pair<double, Output>>> Decoder::decode(
+    const std::vector<ProbsView> &probs_split,
+    std::vector<DecoderStats> *stats,
+    double batch_time_budget_ms,
+    double utterance_time_budget_ms,
+    std::vector<bool> *degraded) {
+  // number of samples
+  size_t batch_size = probs_split.size();
+  // each worker sets the element of its own sample
+  if (stats != nullptr) {
+    stats->assign(batch_size, DecoderStats());
+  }
+  // a vector<bool> packs its elements, the workers set their own flag in
+  // sample_degraded, copied afterwards
+  std::vector<char> sample_degraded(batch_size, 0);
+  std::chrono::steady_clock::time_point batch_deadline =
+      after(std::chrono::steady_clock::now(), batch_time_budget_ms);
+
+  // enqueue the tasks of decoding, the views are shared with the workers
+  // and stay valid until every result has been collected below
+  std::vector<std::future<std::vector<std::pair<double, Output>>>> res(
+      batch_size);
+  for (size_t i : longest_first(probs_split)) {
+    const ProbsView &probs = probs_split[i];
+    DecoderStats *sample_stats = stats != nullptr ? &(*stats)[i] : nullptr;
+    char *is_degraded = &sample_degraded[i];
+    res[i] = pool_->enqueue([this, &probs, sample_stats, is_degraded,
+                             batch_time_budget_ms, utterance_time_budget_ms,
+                             batch_deadline]() {
+      std::unique_ptr<DecoderState> state(create_state());
+      state->set_collect_stats(sample_stats != nullptr);
+      // the earlier of the deadlines of the batch and of the sample
+      if (batch_time_budget_ms > 0.0 || utterance_time_budget_ms > 0.0) {
+        std::chrono::steady_clock::time_point deadline = batch_deadline;
+        if (utterance_time_budget_ms > 0.0) {
+          std::chrono::steady_clock::time_point utterance_deadline =
+              after(std::chrono::steady_clock::now(), utterance_time_budget_ms);
+          if (batch_time_budget_ms <= 0.0 || utterance_deadline < deadline) {
+            deadline = utterance_deadline;
+          }
+        }
+        state->set_deadline(deadline);
+      }
+      state->next(probs);
+      auto result = state->finalize();
+      if (sample_stats != nullptr) {
+        *sample_stats = state->stats();
+      }
+      *is_degraded = state->degraded();
+      return result;
+    });
+  }
+
+  // get decoding results
+  std::vector<std::vector<std::pair<double, Output>>> batch_results;
+  for (size_t i = 0; i < batch_size; ++i) {
+    batch_results.emplace_back(res[i].get());
+  }
+  if (degraded != nullptr) {
+    degraded->assign(sample_degraded.begin(), sample_degraded.end());
+  }
+  return batch_results;
+}
+
+std::vector<std::pair<double, Output>> Decoder::decode_greedy(
+    const std::vector<ProbsView> &probs_split) {
+  // number of samples
+  size_t batch_size = probs_split.size();
+
+  // one task per sample, as the beam search; each one reads its sample once
+  std::vector<std::future<std::pair<double, Output>>> res(batch_size);
+  for (size_t i : longest_first(probs_split)) {
+    res[i] = pool_->enqueue(ctc_greedy_decoder,
+                            probs_split[i],
+                            blank_id_,
+                            log_probs_input_);
+  }
+
+  std::vector<std::pair<double, Output>> batch_results;
+  for (size_t i = 0; i < batch_size; ++i) {
+    batch_results.emplace_back(res[i].get());
+  }
+  return batch_results;
+}
+
+std::vector<std::vector<std::pair<double, Output>>>
+Decoder::decode_with_given_state(const std::vector<ProbsView> &probs_split,
+                                 const std::vector<DecoderState *> &states,
+                                 const std::vector<bool> &is_eos_s) {
+  VALID_CHECK_EQ(probs_split.size(), states.size(),
+                 "The number of states does not match with the batch size");
+  VALID_CHECK_EQ(probs_split.size(), is_eos_s.size(),
+                 "The number of eos flags does not match with the batch size");
+  // number of samples
+  size_t batch_size = probs_split.size();
+
+  // enqueue the tasks of decoding
+  std::vector<std::future<std::vector<std::pair<double, Output>>>> res(
+      batch_size);
+  for (size_t i : longest_first(probs_split)) {
+    const ProbsView &probs = probs_split[i];
+    DecoderState *state = states[i];
+    bool is_eos = is_eos_s[i];
+    res[i] = pool_->enqueue([&probs, state, is_eos]() {
+      state->next(probs);
+      return is_eos ? state->finalize() : state->get_partial();
+    });
+  }
+
+  // get decoding results
+  std::vector<std::vector<std::pair<double, Output>>> batch_results;
+  for (size_t i = 0; i < batch_size; ++i) {
+    batch_results.emplace_back(res[i].get());
+  }
+  return batch_results;
+}
+
+DecoderState *Decoder::create_state() const {
+  DecoderState *state = new DecoderState(vocabulary_,
+                                         beam_size_,
+                                         cutoff_prob_,
+                                         cutoff_top_n_,
+                                         blank_id_,
+                                         ext_scorer_,
+                                         log_probs_input_,
+                                         blank_skip_threshold_,
+                                         beam_threshold_,
+                                         min_beam_size_,
+                                         min_cutoff_top_n_);
+  // the calling worker runs one partition of the expansion itself
+  state->set_expansion_pool(expansion_pool_.get(), num_expansion_threads_ + 1);
+  return state;
+}
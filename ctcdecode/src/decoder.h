@@ -0,0 +1,120 @@
+#ifndef DECODER_H_
+#define DECODER_H_
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ctc_beam_search_decoder.h"
+#include "decoder_stats.h"
+#include "output.h"
+#include "probs_view.h"
+#include "scorer.h"
+
+class ThreadPool;
+
+/* Long lived CTC beam search decoder
+
+ * Holds the vocabulary, the decoding parameters and a pool of worker
+ * threads, so that they are set up once rather than on every call. Calls
+ * from several threads may share one decoder, their utterances are queued
+ * on the same pool.
+ *
+ * Parameters:
+ *     vocabulary: A vector of vocabulary.
+ *     beam_size: The width of beam search.
+ *     num_processes: Number of threads for beam search.
+ *     cutoff_prob: Cutoff probability for pruning.
+ *     cutoff_top_n: Cutoff number for pruning.
+ *     blank_id: Index of the CTC blank label.
+ *     ext_scorer: External scorer to evaluate a prefix, not owned by the
+ *                 decoder. Default null, decoding without scorer.
+ *     log_probs_input: Whether the inputs are log probabilities.
+ *     blank_skip_threshold: Blank probability from which time steps are
+ *                           not expanded. Default 1.0, disabled.
+ *     beam_threshold: Log probability margin below the best prefix beyond
+ *                     which expansions and prefixes are dropped. Default
+ *                     0.0, disabled.
+ *     min_beam_size: Smallest beam width of the adaptive beam, see
+ *                    DecoderState. Default 0, disabled.
+ *     min_cutoff_top_n: Smallest number of candidates per time step of the
+ *                       adaptive beam. Default 0, disabled.
+ *     num_expansion_threads: Number of extra threads splitting the prefix
+ *                            expansion of each time step of an utterance,
+ *                            to lower the latency of single utterances
+ *                            with wide beams and a language model.
+ *                            Default 0, disabled.
+ *
+ * Example:
+ *     Decoder decoder(vocabulary, beam_size, num_processes);
+ *     decoder.decode(batch_1);
+ *     decoder.decode(batch_2);
+*/
+class Decoder {
+public:
+  Decoder(const std::vector<std::string> &vocabulary,
+          size_t beam_size,
+          size_t num_processes,
+          double cutoff_prob = 1.0,
+          size_t cutoff_top_n = 40,
+          size_t blank_id = 0,
+          Scorer *ext_scorer = nullptr,
+          bool log_probs_input = false,
+          double blank_skip_threshold = 1.0,
+          double beam_threshold = 0.0,
+          size_t min_beam_size = 0,
+          size_t min_cutoff_top_n = 0,
+          size_t num_expansion_threads = 0);
+
+  ~Decoder();
+
+  // decode each audio sample of a batch, see ctc_beam_search_decoder_batch().
+  // The performance counters of each sample are set in stats, if not null.
+  // A sample must be decoded within batch_time_budget_ms of the call and
+  // within utterance_time_budget_ms of its own start, if they are not 0;
+  // whether its beam was narrowed to do so is set in degraded, if not null.
+  std::vector<std::vector<std::pair<double, Output>>> decode(
+      const std::vector<ProbsView> &probs_split,
+      std::vector<DecoderStats> *stats = nullptr,
+      double batch_time_budget_ms = 0.0,
+      double utterance_time_budget_ms = 0.0,
+      std::vector<bool> *degraded = nullptr);
+
+  // best path of each audio sample of a batch, see ctc_greedy_decoder()
+  std::vector<std::pair<double, Output>> decode_greedy(
+      const std::vector<ProbsView> &probs_split);
+
+  // advance the streams of a batch by one chunk each, see
+  // ctc_beam_search_decoder_with_given_state_batch()
+  std::vector<std::vector<std::pair<double, Output>>> decode_with_given_state(
+      const std::vector<ProbsView> &probs_split,
+      const std::vector<DecoderState *> &states,
+      const std::vector<bool> &is_eos_s);
+
+  // return a new streaming state with the parameters of the decoder, owned
+  // by the caller
+  DecoderState *create_state() const;
+
+  const std::vector<std::string> &vocabulary() const { return vocabulary_; }
+
+private:
+  std::vector<std::string> vocabulary_;
+  size_t beam_size_;
+  double cutoff_prob_;
+  size_t cutoff_top_n_;
+  size_t blank_id_;
+  Scorer *ext_scorer_;
+  bool log_probs_input_;
+  double blank_skip_threshold_;
+  double beam_threshold_;
+  size_t min_beam_size_;
+  size_t min_cutoff_top_n_;
+
+  std::unique_ptr<ThreadPool> pool_;
+  // shared by the utterances decoded concurrently, null if disabled
+  std::unique_ptr<ThreadPool> expansion_pool_;
+  size_t num_expansion_threads_;
+};
+
+#endif  // DECODER_H_
@@ -0,0 +1,80 @@
+#ifndef DECODER_STATS_H_
+#define DECODER_STATS_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/* Performance counters of the decoding of one utterance, filled by a
+ * DecoderState on request. Times are wall times in milliseconds; lm_ms and
+ * the lm counters are summed over the expansion threads, if any, and
+ * expansion_ms includes the lm scoring of the expansion.
+ */
+struct DecoderStats {
+  // time steps decoded, those of them skipped as blank, and those decoded
+  // with a beam narrowed to meet a deadline
+  uint64_t num_frames = 0;
+  uint64_t num_skipped_frames = 0;
+  uint64_t num_degraded_frames = 0;
+  // (prefix, character) extensions considered after pruning
+  uint64_t num_candidates = 0;
+  // extensions reaching an existing trie node, creating one, or rejected
+  // by the dictionary
+  uint64_t num_trie_hits = 0;
+  uint64_t num_trie_new_nodes = 0;
+  uint64_t num_dictionary_rejections = 0;
+  // lm scores requested, and the lm lookups they took, answered by the
+  // model or by the scorer's cache
+  uint64_t num_lm_requests = 0;
+  uint64_t num_lm_queries = 0;
+  uint64_t num_lm_cache_hits = 0;
+  // highest number of live trie nodes
+  uint64_t peak_live_nodes = 0;
+
+  double pruning_ms = 0.0;
+  double expansion_ms = 0.0;
+  double lm_ms = 0.0;
+  double selection_ms = 0.0;
+  double finalize_ms = 0.0;
+
+  void merge(const DecoderStats &other) {
+    num_frames += other.num_frames;
+    num_skipped_frames += other.num_skipped_frames;
+    num_degraded_frames += other.num_degraded_frames;
+    num_candidates += other.num_candidates;
+    num_trie_hits += other.num_trie_hits;
+    num_trie_new_nodes += other.num_trie_new_nodes;
+    num_dictionary_rejections += other.num_dictionary_rejections;
+    num_lm_requests += other.num_lm_requests;
+    num_lm_queries += other.num_lm_queries;
+    num_lm_cache_hits += other.num_lm_cache_hits;
+    peak_live_nodes = std::max(peak_live_nodes, other.peak_live_nodes);
+    pruning_ms += other.pruning_ms;
+    expansion_ms += other.expansion_ms;
+    lm_ms += other.lm_ms;
+    selection_ms += other.selection_ms;
+    finalize_ms += other.finalize_ms;
+  }
+
+  // every field in declaration order, as exported by the binding
+  std::vector<double> to_vector() const {
+    return {static_cast<double>(num_frames),
+            static_cast<double>(num_skipped_frames),
+            static_cast<double>(num_degraded_frames),
+            static_cast<double>(num_candidates),
+            static_cast<double>(num_trie_hits),
+            static_cast<double>(num_trie_new_nodes),
+            static_cast<double>(num_dictionary_rejections),
+            static_cast<double>(num_lm_requests),
+            static_cast<double>(num_lm_queries),
+            static_cast<double>(num_lm_cache_hits),
+            static_cast<double>(peak_live_nodes),
+            pruning_ms,
+            expansion_ms,
+            lm_ms,
+            selection_ms,
+            finalize_ms};
+  }
+};
+
+#endif  // DECODER_STATS_H_
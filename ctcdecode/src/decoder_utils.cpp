@@ -4,37 +4,165 @@
 #include <cmath>
 #include <limits>
 
-std::vector<std::pair<size_t, float>> get_pruned_log_probs(
-    const std::vector<double> &prob_step,
-    double cutoff_prob,
-    size_t cutoff_top_n) {
-  std::vector<std::pair<int, double>> prob_idx;
-  for (size_t i = 0; i < prob_step.size(); ++i) {
-    prob_idx.push_back(std::pair<int, double>(i, prob_step[i]));
-  }
-  // pruning of vacobulary
-  size_t cutoff_len = prob_step.size();
-  if (cutoff_prob < 1.0 || cutoff_top_n < cutoff_len) {
-    std::sort(
-        prob_idx.begin(), prob_idx.end(), pair_comp_second_rev<int, double>);
-    if (cutoff_prob < 1.0) {
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef CTC_FAST_LOG_SUM_EXP
+// log1p(exp(-i / kLogSumExpTableScale)) for each step up to and including
+// kLogSumExpMaxDiff, the end of the last interpolated step
+static std::vector<float> make_log_sum_exp_table() {
+  int size = static_cast<int>(kLogSumExpMaxDiff) * kLogSumExpTableScale + 1;
+  std::vector<float> table(size);
+  for (int i = 0; i < size; ++i) {
+    table[i] = static_cast<float>(
+        std::log1p(std::exp(-static_cast<double>(i) / kLogSumExpTableScale)));
+  }
+  return table;
+}
+
+static const std::vector<float> log_sum_exp_table_storage =
+    make_log_sum_exp_table();
+const float *const log_sum_exp_table = log_sum_exp_table_storage.data();
+#endif
+
+// Append to candidates the classes of row whose probability is not below
+// *threshold. Whenever more than 2 * k candidates are held, only the k best
+// are kept and *threshold is raised to the k-th best probability, so most
+// of the row is rejected by a single comparison.
+static void select_candidates(const ProbsView &probs,
+                              size_t time_step,
+                              size_t k,
+                              float *threshold,
+                              std::vector<std::pair<size_t, float>> *candidates) {
+  auto shrink = [&]() {
+    std::nth_element(candidates->begin(),
+                     candidates->begin() + (k - 1),
+                     candidates->end(),
+                     pair_comp_second_rev<size_t, float>);
+    *threshold = (*candidates)[k - 1].second;
+    candidates->resize(k);
+  };
+
+  const float *row = probs.data + time_step * probs.time_stride;
+  size_t num_classes = probs.num_classes;
+  size_t i = 0;
+#if defined(__SSE2__)
+  if (probs.class_stride == 1) {
+    // compare four classes at once, only the lanes that pass the threshold
+    // are looked at individually
+    for (; i + 4 <= num_classes; i += 4) {
+      __m128 values = _mm_loadu_ps(row + i);
+      int mask = _mm_movemask_ps(_mm_cmpge_ps(values, _mm_set1_ps(*threshold)));
+      while (mask != 0) {
+        int lane = __builtin_ctz(mask);
+        mask &= mask - 1;
+        candidates->emplace_back(i + lane, row[i + lane]);
+      }
+      if (candidates->size() >= 2 * k) shrink();
+    }
+  }
+#endif
+  for (; i < num_classes; ++i) {
+    float value = row[i * probs.class_stride];
+    if (value >= *threshold) {
+      candidates->emplace_back(i, value);
+      if (candidates->size() >= 2 * k) shrink();
+    }
+  }
+  if (candidates->size() > k) shrink();
+}
+
+void get_pruned_log_probs(const ProbsView &probs,
+                          size_t time_step,
+                          double cutoff_prob,
+                          size_t cutoff_top_n,
+                          bool log_probs_input,
+                          std::vector<std::pair<size_t, float>> *log_prob_idx) {
+  log_prob_idx->clear();
+  size_t num_classes = probs.num_classes;
+  if (cutoff_prob < 1.0 || cutoff_top_n < num_classes) {
+    // pruning of vocabulary: select the cutoff_top_n most probable classes
+    // in descending order, without sorting the whole vocabulary. As in the
+    // original decoder, cutoff_top_n only bounds the cumulative probability
+    // cutoff: with cutoff_prob 1.0 every class is kept, sorted
+    size_t k = cutoff_prob < 1.0 ? std::min(cutoff_top_n, num_classes) : num_classes;
+    if (k == 0) return;
+    float threshold = -std::numeric_limits<float>::infinity();
+    select_candidates(probs, time_step, k, &threshold, log_prob_idx);
+    std::sort(log_prob_idx->begin(),
+              log_prob_idx->end(),
+              pair_comp_second_rev<size_t, float>);
+
+    // the cumulative probability cutoff only looks at the selected classes
+    if (cutoff_prob < 1.0 && log_probs_input) {
+      // accumulate in log scale, the inputs are never exponentiated
+      double log_cutoff_prob = std::log(cutoff_prob);
+      double log_cum_prob = -NUM_FLT_INF;
+      size_t cutoff_len = 0;
+      while (cutoff_len < log_prob_idx->size()) {
+        log_cum_prob = log_sum_exp(log_cum_prob,
+                                   (double)(*log_prob_idx)[cutoff_len++].second);
+        if (log_cum_prob >= log_cutoff_prob) break;
+      }
+      log_prob_idx->resize(cutoff_len);
+    } else if (cutoff_prob < 1.0) {
       double cum_prob = 0.0;
-      cutoff_len = 0;
-      for (size_t i = 0; i < prob_idx.size(); ++i) {
-        cum_prob += prob_idx[i].second;
-        cutoff_len += 1;
-        if (cum_prob >= cutoff_prob || cutoff_len >= cutoff_top_n) break;
+      size_t cutoff_len = 0;
+      while (cutoff_len < log_prob_idx->size()) {
+        cum_prob += (*log_prob_idx)[cutoff_len++].second;
+        if (cum_prob >= cutoff_prob) break;
       }
+      log_prob_idx->resize(cutoff_len);
+    }
+  } else {
+    for (size_t i = 0; i < num_classes; ++i) {
+      log_prob_idx->emplace_back(i, probs.at(time_step, i));
+    }
+  }
+  if (!log_probs_input) {
+    for (auto &entry : *log_prob_idx) {
+      entry.second = log(entry.second + NUM_FLT_MIN);
     }
-    prob_idx = std::vector<std::pair<int, double>>(
-        prob_idx.begin(), prob_idx.begin() + cutoff_len);
   }
-  std::vector<std::pair<size_t, float>> log_prob_idx;
-  for (size_t i = 0; i < cutoff_len; ++i) {
-    log_prob_idx.push_back(std::pair<int, float>(
-        prob_idx[i].first, log(prob_idx[i].second + NUM_FLT_MIN)));
+}
+
+float normalized_entropy(const std::vector<std::pair<size_t, float>> &log_prob_idx) {
+  size_t n = log_prob_idx.size();
+  if (n <= 1) return 0.0f;
+  float max_log_prob = -NUM_FLT_INF;
+  for (const auto &entry : log_prob_idx) {
+    max_log_prob = std::max(max_log_prob, entry.second);
+  }
+  if (!(max_log_prob > -NUM_FLT_INF)) return 0.0f;
+  // with d = log p - max log p, and z the sum of exp(d):
+  // H = log z - sum(exp(d) * d) / z
+  float z = 0.0f;
+  float weighted = 0.0f;
+  for (const auto &entry : log_prob_idx) {
+    float d = entry.second - max_log_prob;
+    float e = std::exp(d);
+    // the impossible candidates, at -inf, add nothing
+    if (e > 0.0f) {
+      z += e;
+      weighted += e * d;
+    }
   }
-  return log_prob_idx;
+  float entropy = std::log(z) - weighted / z;
+  return std::min(std::max(entropy / std::log(static_cast<float>(n)), 0.0f), 1.0f);
+}
+
+ProbsView make_probs_view(const std::vector<std::vector<double>> &probs_seq,
+                          std::vector<float> *buffer) {
+  size_t num_classes = probs_seq.empty() ? 0 : probs_seq[0].size();
+  buffer->clear();
+  buffer->reserve(probs_seq.size() * num_classes);
+  for (const auto &prob : probs_seq) {
+    VALID_CHECK_EQ(prob.size(), num_classes,
+                   "All time steps must have the same number of classes");
+    buffer->insert(buffer->end(), prob.begin(), prob.end());
+  }
+  return ProbsView(buffer->data(), probs_seq.size(), num_classes, num_classes, 1);
 }
 
 
@@ -115,20 +243,72 @@ void add_word_to_fst(const std::vector<int> &word,
   dictionary->SetFinal(dst, fst::StdArc::Weight::One());
 }
 
-bool add_word_to_dictionary(
-    const std::string &word,
-    const std::unordered_map<std::string, int> &char_map,
-    fst::StdVectorFst *dictionary) {
+void build_dictionary_trie(const std::vector<std::vector<int>> &words,
+                           fst::StdVectorFst *dictionary,
+                           std::vector<fst::StdVectorFst::StateId> *final_states) {
+  // insert the words in lexicographic order, so that each word only shares
+  // a prefix with the previous one and its new arc is the greatest label of
+  // the state it leaves
+  std::vector<size_t> order(words.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&words](size_t a, size_t b) {
+    return words[a] < words[b];
+  });
+
+  fst::StdVectorFst::StateId start = dictionary->AddState();
+  dictionary->SetStart(start);
+  final_states->assign(words.size(), start);
+
+  // states along the previous word, path[i] reached after i labels
+  std::vector<fst::StdVectorFst::StateId> path(1, start);
+  const std::vector<int> *prev = nullptr;
+  for (size_t i : order) {
+    const std::vector<int> &word = words[i];
+    size_t shared = 0;
+    if (prev != nullptr) {
+      while (shared < word.size() && shared < prev->size() &&
+             word[shared] == (*prev)[shared]) {
+        ++shared;
+      }
+    }
+    path.resize(shared + 1);
+    for (size_t j = shared; j < word.size(); ++j) {
+      fst::StdVectorFst::StateId dst = dictionary->AddState();
+      dictionary->AddArc(path.back(), fst::StdArc(word[j], word[j], 0, dst));
+      path.push_back(dst);
+    }
+    dictionary->SetFinal(path.back(), fst::StdArc::Weight::One());
+    (*final_states)[i] = path.back();
+    prev = &word;
+  }
+}
+
+bool word_to_labels(const std::string &word,
+                    const std::unordered_map<std::string, int> &char_map,
+                    std::vector<int> *labels) {
   auto characters = split_str(word, "_");
-  std::vector<int> int_word;
+  labels->clear();
   for (auto &c : characters) {
     auto int_c = char_map.find(c);
     if (int_c != char_map.end()) {
-      int_word.push_back(int_c->second);
+      labels->push_back(int_c->second);
     } else {
-      return false;  // return without adding
+      return false;
     }
   }
+  return true;
+}
+
+bool add_word_to_dictionary(
+    const std::string &word,
+    const std::unordered_map<std::string, int> &char_map,
+    fst::StdVectorFst *dictionary) {
+  std::vector<int> int_word;
+  if (!word_to_labels(word, char_map, &int_word)) {
+    return false;  // return without adding
+  }
   add_word_to_fst(int_word, dictionary);
   return true;  // return with successful adding
 }
@@ -5,6 +5,7 @@
 #include "fst/log.h"
 #include "path_trie.h"
 #include "output.h"
+#include "probs_view.h"
 
 const float NUM_FLT_INF  = std::numeric_limits<float>::max();
 const float NUM_FLT_MIN  = std::numeric_limits<float>::min();
@@ -40,21 +41,66 @@ bool pair_comp_second_rev(const std::pair<T1, T2> &a,
   return a.second > b.second;
 }
 
-// Return the sum of two probabilities in log scale
+// Return the sum of two probabilities in log scale, as
+// max(x, y) + log(1 + exp(-|x - y|)), with a single exp
 template <typename T>
 T log_sum_exp(const T &x, const T &y) {
-  static T num_min = -std::numeric_limits<T>::max();
+  static const T num_min = -std::numeric_limits<T>::max();
   if (x <= num_min) return y;
   if (y <= num_min) return x;
   T xmax = std::max(x, y);
-  return std::log(std::exp(x - xmax) + std::exp(y - xmax)) + xmax;
+  T xmin = std::min(x, y);
+  return xmax + std::log(1 + std::exp(xmin - xmax));
 }
 
-// Get pruned probability vector for each time step's beam search
-std::vector<std::pair<size_t, float>> get_pruned_log_probs(
-    const std::vector<double> &prob_step,
-    double cutoff_prob,
-    size_t cutoff_top_n);
+#ifdef CTC_FAST_LOG_SUM_EXP
+/* Table of log1p(exp(-d)) for d = i / kLogSumExpTableScale, up to
+ * kLogSumExpMaxDiff, interpolated linearly by the float log_sum_exp below.
+ * The interpolation error is at most step^2 / 8 * max|f''| = 7.7e-6, with
+ * f''(d) <= 1/4, and the term is dropped beyond kLogSumExpMaxDiff, where it
+ * is below 1.2e-7: the result is within 1e-5 of the exact log sum, i.e. the
+ * sum of the probabilities within a relative error of 1e-5.
+ */
+const int kLogSumExpTableScale = 64;
+const float kLogSumExpMaxDiff = 16.0f;
+extern const float *const log_sum_exp_table;
+
+// Built with -DCTC_FAST_LOG_SUM_EXP, the float sums of the decoder look the
+// log1p(exp(-d)) term up in a table instead of computing exp and log
+template <>
+inline float log_sum_exp<float>(const float &x, const float &y) {
+  static const float num_min = -std::numeric_limits<float>::max();
+  if (x <= num_min) return y;
+  if (y <= num_min) return x;
+  float xmax = std::max(x, y);
+  float d = (xmax - std::min(x, y)) * kLogSumExpTableScale;
+  if (!(d < kLogSumExpMaxDiff * kLogSumExpTableScale)) return xmax;
+  int i = static_cast<int>(d);
+  float frac = d - i;
+  return xmax + log_sum_exp_table[i] +
+         frac * (log_sum_exp_table[i + 1] - log_sum_exp_table[i]);
+}
+#endif
+
+// Get pruned log probability vector for each time step's beam search into
+// log_prob_idx, whose storage is reused across time steps. The entries of
+// probs are log probabilities if log_probs_input is set
+void get_pruned_log_probs(const ProbsView &probs,
+                          size_t time_step,
+                          double cutoff_prob,
+                          size_t cutoff_top_n,
+                          bool log_probs_input,
+                          std::vector<std::pair<size_t, float>> *log_prob_idx);
+
+// Entropy of the distribution of the pruned candidates of a time step, as
+// given by get_pruned_log_probs() and renormalized, divided by its maximum
+// log(n): 0 when a single candidate holds all the probability, 1 when they
+// are all equally probable
+float normalized_entropy(const std::vector<std::pair<size_t, float>> &log_prob_idx);
+
+// Copy a 2-D vector of probabilities into buffer and return a view on it
+ProbsView make_probs_view(const std::vector<std::vector<double>> &probs_seq,
+                          std::vector<float> *buffer);
 
 // Get beam search result from prefixes in trie tree
 std::vector<std::pair<double, Output>> get_beam_search_result(
@@ -75,6 +121,27 @@ std::vector<std::string> split_str(const std::string &s,
 void add_word_to_fst(const std::vector<int> &word,
                      fst::StdVectorFst *dictionary);
 
+/* Build the dictionary of words in index as a trie: the words sharing a
+ * prefix share its states, so the fst is deterministic and its arcs sorted
+ * by label without determinization. Its size is proportional to the one of
+ * the trie rather than to the total length of the words.
+ *
+ * Parameters:
+ *     words: Non empty words in index, in any order.
+ *     dictionary: Empty fst to build the dictionary in.
+ *     final_states: Set to the final state of each word, the same state for
+ *                   repeated words.
+ */
+void build_dictionary_trie(const std::vector<std::vector<int>> &words,
+                           fst::StdVectorFst *dictionary,
+                           std::vector<fst::StdVectorFst::StateId> *final_states);
+
+// Convert a word in string to its label indices, return false if a
+// character of the word is not in char_map
+bool word_to_labels(const std::string &word,
+                    const std::unordered_map<std::string, int> &char_map,
+                    std::vector<int> *labels);
+
 // Add a word in string to dictionary
 bool add_word_to_dictionary(
     const std::string &word,
@@ -0,0 +1,187 @@
+#include "lexicon.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+
+#include "decoder_utils.h"
+
+const Lexicon::StateId Lexicon::kNoState;
+const size_t Lexicon::kMinDenseArcs;
+const size_t Lexicon::kDenseRatio;
+const ptrdiff_t Lexicon::kMaxLinearSearch;
+
+static const char LEXICON_MAGIC[8] = {'C', 'T', 'C', 'D', 'L', 'E', 'X', '1'};
+
+Lexicon::Layout Lexicon::get_layout(const Header &header) {
+  Layout layout;
+  layout.arc_begin = sizeof(Header);
+  layout.arc_label = layout.arc_begin + (header.num_states + 1) * sizeof(uint32_t);
+  layout.arc_next = layout.arc_label + header.num_arcs * sizeof(int32_t);
+  layout.dense_row = layout.arc_next + header.num_arcs * sizeof(int32_t);
+  layout.dense = layout.dense_row + header.num_states * sizeof(int32_t);
+  layout.final = layout.dense + static_cast<size_t>(header.num_dense_rows) *
+                                    header.num_labels * sizeof(int32_t);
+  layout.size = layout.final + header.num_states * sizeof(uint8_t);
+  return layout;
+}
+
+Lexicon::Lexicon(const fst::StdVectorFst &dictionary, size_t num_labels)
+    : map_(nullptr), map_size_(0) {
+  VALID_CHECK_GT(dictionary.NumStates(), 0, "The dictionary is empty");
+  size_t num_states = dictionary.NumStates();
+
+  std::vector<uint32_t> arc_begin(1, 0);
+  std::vector<int32_t> arc_label, arc_next, dense_row(num_states, -1), dense;
+  std::vector<uint8_t> final(num_states);
+  for (size_t s = 0; s < num_states; ++s) {
+    size_t num_arcs = dictionary.NumArcs(s);
+    bool is_dense = num_arcs >= kMinDenseArcs && num_arcs * kDenseRatio >= num_labels;
+    if (is_dense) {
+      dense_row[s] = dense.size() / num_labels;
+      dense.resize(dense.size() + num_labels, kNoState);
+    }
+    for (fst::ArcIterator<fst::StdVectorFst> aiter(dictionary, s); !aiter.Done(); aiter.Next()) {
+      const fst::StdArc &arc = aiter.Value();
+      VALID_CHECK(arc.ilabel >= 0 && static_cast<size_t>(arc.ilabel) < num_labels,
+                  "Dictionary label out of range");
+      VALID_CHECK(arc_label.size() == arc_begin.back() || arc_label.back() < arc.ilabel,
+                  "The dictionary arcs must be sorted and deterministic");
+      arc_label.push_back(arc.ilabel);
+      arc_next.push_back(arc.nextstate);
+      if (is_dense) {
+        dense[dense_row[s] * num_labels + arc.ilabel] = arc.nextstate;
+      }
+    }
+    arc_begin.push_back(arc_label.size());
+    final[s] = dictionary.Final(s) != fst::TropicalWeight::Zero();
+  }
+
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, LEXICON_MAGIC, sizeof(header.magic));
+  header.num_states = num_states;
+  header.num_arcs = arc_label.size();
+  header.num_labels = num_labels;
+  header.num_dense_rows = num_labels > 0 ? dense.size() / num_labels : 0;
+  header.start = dictionary.Start();
+
+  Layout layout = get_layout(header);
+  buffer_.resize(layout.size);
+  char *data = buffer_.data();
+  std::memcpy(data, &header, sizeof(header));
+  auto copy = [data](size_t offset, const void *array, size_t size) {
+    if (size > 0) {
+      std::memcpy(data + offset, array, size);
+    }
+  };
+  copy(layout.arc_begin, arc_begin.data(), arc_begin.size() * sizeof(uint32_t));
+  copy(layout.arc_label, arc_label.data(), arc_label.size() * sizeof(int32_t));
+  copy(layout.arc_next, arc_next.data(), arc_next.size() * sizeof(int32_t));
+  copy(layout.dense_row, dense_row.data(), dense_row.size() * sizeof(int32_t));
+  copy(layout.dense, dense.data(), dense.size() * sizeof(int32_t));
+  copy(layout.final, final.data(), final.size() * sizeof(uint8_t));
+  VALID_CHECK(attach(data, layout.size), "Invalid dictionary");
+}
+
+Lexicon::~Lexicon() {
+  if (map_ != nullptr) {
+    munmap(map_, map_size_);
+  }
+}
+
+Lexicon *Lexicon::map(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+
+  Lexicon *lexicon = new Lexicon;
+  lexicon->map_ = data;
+  lexicon->map_size_ = st.st_size;
+  if (!lexicon->attach(static_cast<const char *>(data), st.st_size)) {
+    delete lexicon;
+    return nullptr;
+  }
+  return lexicon;
+}
+
+bool Lexicon::write(const std::string &path) const {
+  std::ofstream strm(path, std::ios_base::out | std::ios_base::binary);
+  strm.write(reinterpret_cast<const char *>(header_), get_layout(*header_).size);
+  return static_cast<bool>(strm);
+}
+
+bool Lexicon::attach(const char *data, size_t size) {
+  if (size < sizeof(Header)) {
+    return false;
+  }
+  header_ = reinterpret_cast<const Header *>(data);
+  if (!std::equal(LEXICON_MAGIC, LEXICON_MAGIC + sizeof(LEXICON_MAGIC), header_->magic)) {
+    return false;
+  }
+  // bound the counts before computing sizes from them
+  if (header_->num_states >= size || header_->num_arcs >= size ||
+      header_->num_labels >= size || header_->num_dense_rows > header_->num_states) {
+    return false;
+  }
+  Layout layout = get_layout(*header_);
+  if (layout.size != size) {
+    return false;
+  }
+  arc_begin_ = reinterpret_cast<const uint32_t *>(data + layout.arc_begin);
+  arc_label_ = reinterpret_cast<const int32_t *>(data + layout.arc_label);
+  arc_next_ = reinterpret_cast<const int32_t *>(data + layout.arc_next);
+  dense_row_ = reinterpret_cast<const int32_t *>(data + layout.dense_row);
+  dense_ = reinterpret_cast<const int32_t *>(data + layout.dense);
+  final_ = reinterpret_cast<const uint8_t *>(data + layout.final);
+
+  // check every index once, so that lookups need not
+  int32_t num_states = header_->num_states;
+  if (num_states <= 0 || header_->start < 0 || header_->start >= num_states ||
+      arc_begin_[0] != 0 || arc_begin_[num_states] != header_->num_arcs) {
+    return false;
+  }
+  for (int32_t s = 0; s < num_states; ++s) {
+    if (arc_begin_[s] > arc_begin_[s + 1] || dense_row_[s] < -1 ||
+        dense_row_[s] >= static_cast<int32_t>(header_->num_dense_rows)) {
+      return false;
+    }
+  }
+  for (uint32_t a = 0; a < header_->num_arcs; ++a) {
+    if (arc_next_[a] < 0 || arc_next_[a] >= num_states) {
+      return false;
+    }
+  }
+  // the arcs of each state are searched by label, which must be sorted,
+  // unique and in range
+  for (int32_t s = 0; s < num_states; ++s) {
+    int32_t prev_label = -1;
+    for (uint32_t a = arc_begin_[s]; a < arc_begin_[s + 1]; ++a) {
+      if (arc_label_[a] <= prev_label ||
+          static_cast<uint32_t>(arc_label_[a]) >= header_->num_labels) {
+        return false;
+      }
+      prev_label = arc_label_[a];
+    }
+  }
+  size_t dense_size = static_cast<size_t>(header_->num_dense_rows) * header_->num_labels;
+  for (size_t i = 0; i < dense_size; ++i) {
+    if (dense_[i] < kNoState || dense_[i] >= num_states) {
+      return false;
+    }
+  }
+  return true;
+}
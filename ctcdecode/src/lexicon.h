@@ -0,0 +1,134 @@
+#ifndef LEXICON_H_
+#define LEXICON_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fst/fstlib.h"
+
+/* Immutable dictionary automaton of a word based lm, in flat arrays.
+ *
+ * The arcs of every state are stored contiguously, sorted by label, after
+ * the offset of the first arc of each state. States whose arcs cover a large
+ * share of the labels also get a row indexed directly by label. A lookup is
+ * then a few array reads, with no virtual call nor allocation, and a single
+ * lexicon is read by every decoding thread without copies.
+ *
+ * The arrays live in one buffer, the same in memory and on disk, so that a
+ * written lexicon is memory mapped back as is.
+ *
+ * Example:
+ *     Lexicon lexicon(dictionary_fst, num_labels);
+ *     Lexicon::StateId state = lexicon.next(lexicon.start(), label);
+ *     if (state != Lexicon::kNoState && lexicon.is_final(state)) { ... }
+ */
+class Lexicon {
+public:
+  typedef int32_t StateId;
+
+  static const StateId kNoState = -1;
+
+  // flatten a deterministic fst whose arcs are sorted by label, with labels
+  // in [0, num_labels)
+  Lexicon(const fst::StdVectorFst &dictionary, size_t num_labels);
+
+  ~Lexicon();
+
+  // the arrays point into buffer_ or the mapping, which the destructor unmaps
+  Lexicon(const Lexicon &) = delete;
+  Lexicon &operator=(const Lexicon &) = delete;
+
+  // map the lexicon written at path, nullptr if it is missing or invalid
+  static Lexicon *map(const std::string &path);
+
+  // write the lexicon to path, return false on failure
+  bool write(const std::string &path) const;
+
+  StateId start() const { return header_->start; }
+
+  size_t num_states() const { return header_->num_states; }
+
+  size_t num_labels() const { return header_->num_labels; }
+
+  bool is_final(StateId state) const { return final_[state] != 0; }
+
+  // state reached from state by label, kNoState if there is no such arc
+  StateId next(StateId state, int label) const {
+    if (label < 0 || static_cast<uint32_t>(label) >= header_->num_labels) {
+      return kNoState;
+    }
+    int32_t row = dense_row_[state];
+    if (row >= 0) {
+      return dense_[static_cast<size_t>(row) * header_->num_labels + label];
+    }
+    const int32_t *begin = arc_label_ + arc_begin_[state];
+    const int32_t *end = arc_label_ + arc_begin_[state + 1];
+    const int32_t *arc = begin;
+    if (end - begin <= kMaxLinearSearch) {
+      while (arc != end && *arc < label) {
+        ++arc;
+      }
+    } else {
+      arc = std::lower_bound(begin, end, label);
+    }
+    return arc != end && *arc == label ? arc_next_[arc - arc_label_] : kNoState;
+  }
+
+private:
+  struct Header {
+    char magic[8];
+    uint32_t num_states;
+    uint32_t num_arcs;
+    uint32_t num_labels;
+    uint32_t num_dense_rows;
+    int32_t start;
+    uint32_t reserved;
+  };
+
+  // states with at least this many arcs, covering at least 1 / kDenseRatio
+  // of the labels, are indexed by label
+  static const size_t kMinDenseArcs = 8;
+  static const size_t kDenseRatio = 4;
+  // sorted arcs scanned linearly rather than by bisection
+  static const ptrdiff_t kMaxLinearSearch = 8;
+
+  // byte offsets of the arrays in the buffer, and its size
+  struct Layout {
+    size_t arc_begin;
+    size_t arc_label;
+    size_t arc_next;
+    size_t dense_row;
+    size_t dense;
+    size_t final;
+    size_t size;
+  };
+
+  Lexicon() : map_(nullptr), map_size_(0) {}
+
+  static Layout get_layout(const Header &header);
+
+  // point the arrays into the buffer data of size bytes, return false if it
+  // is not a consistent lexicon
+  bool attach(const char *data, size_t size);
+
+  // storage of a built lexicon, empty if mapped
+  std::vector<char> buffer_;
+  void *map_;
+  size_t map_size_;
+
+  const Header *header_;
+  // offset of the first arc of each state, followed by the number of arcs
+  const uint32_t *arc_begin_;
+  const int32_t *arc_label_;
+  const int32_t *arc_next_;
+  // row of each state in dense_, -1 if its arcs are searched
+  const int32_t *dense_row_;
+  // next state of each label, kNoState if there is no arc
+  const int32_t *dense_;
+  const uint8_t *final_;
+};
+
+#endif  // LEXICON_H_
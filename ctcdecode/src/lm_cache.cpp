@@ -0,0 +1,67 @@
+#include "lm_cache.h"
+
+#include <algorithm>
+
+LMScoreCache::LMScoreCache(size_t capacity, size_t num_shards)
+    : capacity_(capacity), hits_(0), misses_(0) {
+  num_shards = std::max<size_t>(1, std::min(num_shards, capacity));
+  shard_capacity_ = std::max<size_t>(1, (capacity + num_shards - 1) / num_shards);
+  for (size_t i = 0; i < num_shards; ++i) {
+    shards_.emplace_back(new Shard);
+    shards_.back()->entries.reserve(shard_capacity_);
+    shards_.back()->next = 0;
+  }
+}
+
+LMScoreCache::Shard &LMScoreCache::get_shard(const Key &key) {
+  // the low bits of the hash pick the bucket inside the shard
+  return *shards_[(KeyHash()(key) >> 16) % shards_.size()];
+}
+
+bool LMScoreCache::find(const lm::ngram::State &state,
+                        lm::WordIndex word,
+                        float *score,
+                        lm::ngram::State *out_state) {
+  Key key;
+  key.state = state;
+  key.word = word;
+  Shard &shard = get_shard(key);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto entry = shard.entries.find(key);
+    if (entry != shard.entries.end()) {
+      *score = entry->second.score;
+      *out_state = entry->second.out_state;
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void LMScoreCache::insert(const lm::ngram::State &state,
+                          lm::WordIndex word,
+                          float score,
+                          const lm::ngram::State &out_state) {
+  Key key;
+  key.state = state;
+  key.word = word;
+  Value value;
+  value.score = score;
+  value.out_state = out_state;
+  Shard &shard = get_shard(key);
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (!shard.entries.emplace(key, value).second) {
+    return;  // inserted by another thread meanwhile
+  }
+  if (shard.order.size() < shard_capacity_) {
+    shard.order.push_back(key);
+    return;
+  }
+  // evict the oldest entry of the shard
+  shard.entries.erase(shard.order[shard.next]);
+  shard.order[shard.next] = key;
+  shard.next = (shard.next + 1) % shard_capacity_;
+}
@@ -0,0 +1,92 @@
+#ifndef LM_CACHE_H_
+#define LM_CACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "lm/state.hh"
+#include "lm/word_index.hh"
+
+/* Bounded cache of language model scores, shared by every decoding thread.
+ *
+ * Entries map an lm context state and a word index to the log10 score of the
+ * word and the resulting state, exactly what lm::base::Model::BaseScore
+ * returns. They are spread over independently locked shards by hash; a full
+ * shard overwrites its oldest entry.
+ *
+ * Example:
+ *     LMScoreCache cache(1 << 20);
+ *     if (!cache.find(state, word, &score, &out_state)) {
+ *       score = model->BaseScore(&state, word, &out_state);
+ *       cache.insert(state, word, score, out_state);
+ *     }
+ */
+class LMScoreCache {
+public:
+  LMScoreCache(size_t capacity, size_t num_shards = 64);
+
+  // look a score up, return false on a miss
+  bool find(const lm::ngram::State &state,
+            lm::WordIndex word,
+            float *score,
+            lm::ngram::State *out_state);
+
+  void insert(const lm::ngram::State &state,
+              lm::WordIndex word,
+              float score,
+              const lm::ngram::State &out_state);
+
+  size_t capacity() const { return capacity_; }
+
+  uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+
+  uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+  struct Key {
+    lm::ngram::State state;
+    lm::WordIndex word;
+
+    bool operator==(const Key &other) const {
+      return word == other.word && state == other.state;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      // spread the word over the high bits, which pick the shard, then fold
+      // them into the low ones, which pick the bucket
+      uint64_t hash = lm::ngram::hash_value(key.state) ^
+                      (static_cast<uint64_t>(key.word) * 0x9e3779b97f4a7c15ULL);
+      return static_cast<size_t>(hash ^ (hash >> 32));
+    }
+  };
+
+  struct Value {
+    float score;
+    lm::ngram::State out_state;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<Key, Value, KeyHash> entries;
+    // keys in insertion order, overwritten from the oldest when full
+    std::vector<Key> order;
+    size_t next;
+  };
+
+  Shard &get_shard(const Key &key);
+
+  size_t capacity_;
+  size_t shard_capacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+};
+
+#endif  // LM_CACHE_H_
@@ -14,6 +14,19 @@
 #include "scorer.h"
 
 PathTrie::PathTrie() {
+  reset();
+}
+
+PathTrie::~PathTrie() {
+  // nodes from an arena are released together with the arena
+  if (arena_ == nullptr) {
+    for (auto child : children_) {
+      delete child.second;
+    }
+  }
+}
+
+void PathTrie::reset() {
   log_prob_b_prev = -NUM_FLT_INF;
   log_prob_nb_prev = -NUM_FLT_INF;
   log_prob_b_cur = -NUM_FLT_INF;
@@ -26,17 +39,36 @@ PathTrie::PathTrie() {
   exists_ = true;
   parent = nullptr;
 
+  lm_log_cond_prob = 0.0;
+  lm_tokens_since_oov = 0;
+  lm_scored = false;
+
   dictionary_ = nullptr;
   dictionary_state_ = 0;
   has_dictionary_ = false;
 
-  matcher_ = nullptr;
+  arena_ = nullptr;
+  active_ = nullptr;
+
+  children_.clear();
 }
 
-PathTrie::~PathTrie() {
-  for (auto child : children_) {
-    delete child.second;
+PathTrie* PathTrie::new_child(int new_char, int new_timestep) {
+  PathTrie* new_path = arena_ != nullptr ? arena_->allocate() : new PathTrie;
+  new_path->character = new_char;
+  new_path->timestep = new_timestep;
+  new_path->parent = this;
+  new_path->arena_ = arena_;
+  new_path->active_ = active_;
+  if (has_dictionary_) {
+    new_path->dictionary_ = dictionary_;
+    new_path->has_dictionary_ = true;
   }
+  children_.push_back(std::make_pair(new_char, new_path));
+  if (active_ != nullptr) {
+    active_->push_back(new_path);
+  }
+  return new_path;
 }
 
 PathTrie* PathTrie::get_path_trie(int new_char, int new_timestep, bool ignore_tokenization_symbol, bool reset) {
@@ -53,6 +85,9 @@ PathTrie* PathTrie::get_path_trie(int new_char, int new_timestep, bool ignore_to
       child->second->log_prob_nb_prev = -NUM_FLT_INF;
       child->second->log_prob_b_cur = -NUM_FLT_INF;
       child->second->log_prob_nb_cur = -NUM_FLT_INF;
+      if (active_ != nullptr) {
+        active_->push_back(child->second);
+      }
     }
     return (child->second);
   } else {
@@ -61,48 +96,25 @@ PathTrie* PathTrie::get_path_trie(int new_char, int new_timestep, bool ignore_to
       // when using tokenization symbols we need to make sure that matching is not done.
       // Also, if it is a tokenization symbol then reset the dictionary to start for next set of matching.
       if (ignore_tokenization_symbol){
-        PathTrie* new_path = new PathTrie;
+        PathTrie* new_path = new_child(new_char, new_timestep);
         // reset dictionary state
-        new_path->dictionary_state_ = dictionary_->Start();
-        new_path->character = new_char;
-        new_path->timestep = new_timestep;
-        new_path->parent = this;
-        new_path->dictionary_ = dictionary_;
-        new_path->has_dictionary_ = true;
-        new_path->matcher_ = matcher_;
-        children_.push_back(std::make_pair(new_char, new_path));
+        new_path->dictionary_state_ = dictionary_->start();
         return new_path;
       }
-      matcher_->SetState(dictionary_state_);
-      bool found = matcher_->Find(new_char);
-      if (!found) {
+      Lexicon::StateId next_state = dictionary_->next(dictionary_state_, new_char);
+      if (next_state == Lexicon::kNoState) {
         // Adding this character causes word outside dictionary
-        auto FSTZERO = fst::TropicalWeight::Zero();
-        auto final_weight = dictionary_->Final(dictionary_state_);
-        bool is_final = (final_weight != FSTZERO);
-        if (is_final && reset) {
-          dictionary_state_ = dictionary_->Start();
+        if (dictionary_->is_final(dictionary_state_) && reset) {
+          dictionary_state_ = dictionary_->start();
         }
         return nullptr;
       } else {
-        PathTrie* new_path = new PathTrie;
-        new_path->character = new_char;
-        new_path->timestep = new_timestep;
-        new_path->parent = this;
-        new_path->dictionary_ = dictionary_;
-        new_path->dictionary_state_ = matcher_->Value().nextstate;
-        new_path->has_dictionary_ = true;
-        new_path->matcher_ = matcher_;
-        children_.push_back(std::make_pair(new_char, new_path));
+        PathTrie* new_path = new_child(new_char, new_timestep);
+        new_path->dictionary_state_ = next_state;
         return new_path;
       }
     } else {
-      PathTrie* new_path = new PathTrie;
-      new_path->character = new_char;
-      new_path->timestep = new_timestep;
-      new_path->parent = this;
-      children_.push_back(std::make_pair(new_char, new_path));
-      return new_path;
+      return new_child(new_char, new_timestep);
     }
   }
 }
@@ -132,13 +144,7 @@ PathTrie* PathTrie::get_path_vec(std::vector<int>& output,
 
 void PathTrie::iterate_to_vec(std::vector<PathTrie*>& output) {
   if (exists_) {
-    log_prob_b_prev = log_prob_b_cur;
-    log_prob_nb_prev = log_prob_nb_cur;
-
-    log_prob_b_cur = -NUM_FLT_INF;
-    log_prob_nb_cur = -NUM_FLT_INF;
-
-    score = log_sum_exp(log_prob_b_prev, log_prob_nb_prev);
+    update_log_probs();
     output.push_back(this);
   }
   for (auto child : children_) {
@@ -146,6 +152,16 @@ void PathTrie::iterate_to_vec(std::vector<PathTrie*>& output) {
   }
 }
 
+void PathTrie::update_log_probs() {
+  log_prob_b_prev = log_prob_b_cur;
+  log_prob_nb_prev = log_prob_nb_cur;
+
+  log_prob_b_cur = -NUM_FLT_INF;
+  log_prob_nb_cur = -NUM_FLT_INF;
+
+  score = log_sum_exp(log_prob_b_prev, log_prob_nb_prev);
+}
+
 void PathTrie::remove() {
   exists_ = false;
 
@@ -163,17 +179,41 @@ void PathTrie::remove() {
       parent->remove();
     }
 
-    delete this;
+    if (arena_ != nullptr) {
+      arena_->release(this);
+    } else {
+      delete this;
+    }
   }
 }
 
-void PathTrie::set_dictionary(fst::StdVectorFst* dictionary) {
+void PathTrie::set_dictionary(const Lexicon* dictionary) {
   dictionary_ = dictionary;
-  dictionary_state_ = dictionary->Start();
+  dictionary_state_ = dictionary->start();
   has_dictionary_ = true;
 }
 
-using FSTMATCH = fst::SortedMatcher<fst::StdVectorFst>;
-void PathTrie::set_matcher(std::shared_ptr<FSTMATCH> matcher) {
-  matcher_ = matcher;
+PathTrieArena::PathTrieArena(size_t slab_size)
+    : slab_size_(std::max<size_t>(slab_size, 1)),
+      num_used_in_slab_(0),
+      num_live_(0) {}
+
+PathTrie* PathTrieArena::allocate() {
+  ++num_live_;
+  if (!free_list_.empty()) {
+    PathTrie* node = free_list_.back();
+    free_list_.pop_back();
+    return node;
+  }
+  if (slabs_.empty() || num_used_in_slab_ == slab_size_) {
+    slabs_.emplace_back(new PathTrie[slab_size_]);
+    num_used_in_slab_ = 0;
+  }
+  return &slabs_.back()[num_used_in_slab_++];
+}
+
+void PathTrieArena::release(PathTrie* node) {
+  --num_live_;
+  node->reset();
+  free_list_.push_back(node);
 }
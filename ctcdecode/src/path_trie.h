@@ -11,7 +11,10 @@
 #include <map>
 #include <unordered_map>
 
-#include "fst/fstlib.h"
+#include "lexicon.h"
+#include "lm/state.hh"
+
+class PathTrieArena;
 
 /* Trie tree for prefix storing and manipulating, with a dictionary in
  * finite-state transducer for spelling correction.
@@ -36,16 +39,29 @@ public:
   // update log probs
   void iterate_to_vec(std::vector<PathTrie*>& output);
 
-  // set dictionary for FST
-  void set_dictionary(fst::StdVectorFst* dictionary);
+  // roll the log probs of the current time step into the previous ones
+  void update_log_probs();
 
-  void set_matcher(std::shared_ptr<fst::SortedMatcher<fst::StdVectorFst>>);
+  // set dictionary for FST
+  void set_dictionary(const Lexicon* dictionary);
 
   bool is_empty() { return ROOT_ == character; }
 
+  bool has_dictionary() const { return has_dictionary_; }
+
+  // state of the dictionary after the characters of the current word
+  Lexicon::StateId dictionary_state() const { return dictionary_state_; }
+
   // remove current path from root
   void remove();
 
+  // allocate the children of this node (and their descendants) from arena
+  void set_arena(PathTrieArena* arena) { arena_ = arena; }
+
+  // record every node that get_path_trie creates or revives below this node
+  // in active, so the caller can update them without walking the trie
+  void set_active_list(std::vector<PathTrie*>* active) { active_ = active; }
+
   float log_prob_b_prev;
   float log_prob_nb_prev;
   float log_prob_b_cur;
@@ -56,18 +72,67 @@ public:
   int timestep;
   PathTrie* parent;
 
+  // language model cache, filled by Scorer::get_log_cond_prob(PathTrie*):
+  // the lm state after the last token ending at this node, the log
+  // conditional probability of that token, and the number of tokens read
+  // since the last out of vocabulary one
+  lm::ngram::State lm_state;
+  float lm_log_cond_prob;
+  int lm_tokens_since_oov;
+  bool lm_scored;
+
 private:
+  friend class PathTrieArena;
+
+  // restore a freshly constructed node
+  void reset();
+
+  // append a new child for new_char, inheriting arena and dictionary
+  PathTrie* new_child(int new_char, int new_timestep);
+
   int ROOT_;
   bool exists_;
   bool has_dictionary_;
 
   std::vector<std::pair<int, PathTrie*>> children_;
 
-  // pointer to dictionary of FST
-  fst::StdVectorFst* dictionary_;
-  fst::StdVectorFst::StateId dictionary_state_;
-  // true if finding ars in FST
-  std::shared_ptr<fst::SortedMatcher<fst::StdVectorFst>> matcher_;
+  // pointer to dictionary, shared by every node
+  const Lexicon* dictionary_;
+  Lexicon::StateId dictionary_state_;
+  // allocator owning the children, nullptr if they are heap allocated
+  PathTrieArena* arena_;
+  // list of the nodes activated since the last update, may be nullptr
+  std::vector<PathTrie*>* active_;
+};
+
+/* Slab allocator for the nodes of one prefix trie.
+ *
+ * Nodes are handed out from fixed size slabs, removed nodes are kept on a
+ * free list and recycled by later expansions, and every node is released at
+ * once when the arena is destroyed. This keeps the trie of one utterance in
+ * a few contiguous blocks instead of one heap allocation per node.
+ */
+class PathTrieArena {
+public:
+  explicit PathTrieArena(size_t slab_size = 1024);
+
+  // the nodes handed out point back to their arena
+  PathTrieArena(const PathTrieArena&) = delete;
+  PathTrieArena& operator=(const PathTrieArena&) = delete;
+
+  PathTrie* allocate();
+
+  void release(PathTrie* node);
+
+  // number of nodes currently handed out
+  size_t num_live() const { return num_live_; }
+
+private:
+  size_t slab_size_;
+  size_t num_used_in_slab_;
+  size_t num_live_;
+  std::vector<std::unique_ptr<PathTrie[]>> slabs_;
+  std::vector<PathTrie*> free_list_;
 };
 
 #endif  // PATH_TRIE_H
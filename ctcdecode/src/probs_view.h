@@ -0,0 +1,42 @@
+#ifndef PROBS_VIEW_H_
+#define PROBS_VIEW_H_
+
+#include <cstddef>
+
+/* Read-only strided view over the float32 probabilities of one audio sample,
+ * so the decoder reads the caller's buffer (e.g. a torch tensor) in place.
+ * The probability of class c at time step t is
+ * data[t * time_stride + c * class_stride].
+ */
+struct ProbsView {
+  const float *data;
+  size_t num_time_steps;
+  size_t num_classes;
+  std::ptrdiff_t time_stride;
+  std::ptrdiff_t class_stride;
+
+  ProbsView()
+      : data(nullptr), num_time_steps(0), num_classes(0), time_stride(0), class_stride(1) {}
+
+  ProbsView(const float *data,
+            size_t num_time_steps,
+            size_t num_classes,
+            std::ptrdiff_t time_stride,
+            std::ptrdiff_t class_stride)
+      : data(data),
+        num_time_steps(num_time_steps),
+        num_classes(num_classes),
+        time_stride(time_stride),
+        class_stride(class_stride) {}
+
+  float at(size_t time_step, size_t c) const {
+    return data[time_step * time_stride + c * class_stride];
+  }
+
+  // view of the time steps [begin, end)
+  ProbsView slice(size_t begin, size_t end) const {
+    return ProbsView(data + begin * time_stride, end - begin, num_classes, time_stride, class_stride);
+  }
+};
+
+#endif  // PROBS_VIEW_H_
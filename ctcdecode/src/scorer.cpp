@@ -1,11 +1,17 @@
 #include "scorer.h"
 
 #include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <vector>
 #include <map>
 #include <unordered_map>
 
+#include "lm/binary_format.hh"
 #include "lm/config.hh"
 #include "lm/model.hh"
 #include "lm/state.hh"
@@ -20,51 +26,75 @@ Scorer::Scorer(double alpha,
                double beta,
                const std::string& lm_path,
                const std::vector<std::string>& char_list,
-               const std::vector<std::string>& tokenization_char_list) {
+               const std::vector<std::string>& tokenization_char_list,
+               const std::string& dictionary_cache_dir,
+               util::LoadMethod load_method) {
   this->alpha = alpha;
   this->beta = beta;
 
-  dictionary = nullptr;
   is_character_based_ = true;
   language_model_ = nullptr;
 
   max_order_ = 0;
   dict_size_ = 0;
-  
-  setup(lm_path, char_list, tokenization_char_list);
+
+  setup(lm_path, char_list, tokenization_char_list, dictionary_cache_dir, load_method);
 }
 
 Scorer::~Scorer() {
   if (language_model_ != nullptr) {
     delete static_cast<lm::base::Model*>(language_model_);
   }
-  if (dictionary != nullptr) {
-    delete static_cast<fst::StdVectorFst*>(dictionary);
-  }
 }
 
 void Scorer::setup(const std::string& lm_path,
                    const std::vector<std::string>& char_list,
-                   const std::vector<std::string>& tokenization_char_list) {
+                   const std::vector<std::string>& tokenization_char_list,
+                   const std::string& dictionary_cache_dir,
+                   util::LoadMethod load_method) {
   // load language model
-  load_lm(lm_path);
+  load_lm(lm_path, load_method);
   // set char map for scorer
   set_char_map(char_list);
   // set tokenization symbol set based on char_map
   set_tokenization_char_map(tokenization_char_list);
-  // fill the dictionary for FST
+  // look the labels up in the lm vocabulary once
+  lm::base::Model* model = static_cast<lm::base::Model*>(language_model_);
+  label_word_index_.clear();
+  for (const auto& label : char_list_) {
+    label_word_index_.push_back(model->BaseVocabulary().Index(label));
+  }
+  // fill the dictionary, or map the one cached by an earlier scorer
   if (!is_character_based()) {
-    fill_dictionary();
+    std::string cache_path;
+    if (!dictionary_cache_dir.empty()) {
+      cache_path = dictionary_cache_path(dictionary_cache_dir);
+    }
+    if (cache_path.empty() || !load_dictionary(cache_path)) {
+      fill_dictionary();
+      if (!cache_path.empty()) {
+        save_dictionary(cache_path);
+      }
+    }
   }
 }
 
-void Scorer::load_lm(const std::string& lm_path) {
+void Scorer::load_lm(const std::string& lm_path, util::LoadMethod load_method) {
   const char* filename = lm_path.c_str();
   VALID_CHECK_EQ(access(filename, F_OK), 0, "Invalid language model path");
 
+  lm::ngram::ModelType model_type;
+  if (!lm::ngram::RecognizeBinary(filename, model_type)) {
+    std::cerr << "warning: " << lm_path << " is an ARPA file, parsed into the "
+              << "memory of each process. Convert it with KenLM's build_binary "
+              << "to load it faster and share it between processes."
+              << std::endl;
+  }
+
   RetriveStrEnumerateVocab enumerate;
   lm::ngram::Config config;
   config.enumerate_vocab = &enumerate;
+  config.load_method = load_method;
   language_model_ = lm::ngram::LoadVirtual(filename, config);
   max_order_ = static_cast<lm::base::Model*>(language_model_)->Order();
   vocabulary_ = enumerate.vocabulary;
@@ -99,6 +129,94 @@ double Scorer::get_log_cond_prob(const std::vector<std::string>& words) {
   return cond_prob/NUM_FLT_LOGE;
 }
 
+double Scorer::get_log_cond_prob(PathTrie* prefix, DecoderStats* stats) {
+  if (stats != nullptr) {
+    ++stats->num_lm_requests;
+  }
+  if (!prefix->lm_scored) {
+    score_prefix(prefix, stats);
+  }
+  return prefix->lm_log_cond_prob;
+}
+
+void Scorer::score_prefix(PathTrie* prefix, DecoderStats* stats) {
+  lm::base::Model* model = static_cast<lm::base::Model*>(language_model_);
+  prefix->lm_scored = true;
+
+  if (prefix->is_empty()) {
+    // the history of the first word: max_order - 1 start tokens, as padded
+    // by make_ngram
+    lm::ngram::State state;
+    lm::WordIndex start_index = model->BaseVocabulary().Index(START_TOKEN);
+    double cond_prob = 0.0;
+    model->NullContextWrite(&state);
+    for (size_t i = 0; i + 1 < max_order_; ++i) {
+      cond_prob = base_score(state, start_index, &prefix->lm_state, stats);
+      state = prefix->lm_state;
+    }
+    prefix->lm_state = state;
+    prefix->lm_log_cond_prob = cond_prob / NUM_FLT_LOGE;
+    prefix->lm_tokens_since_oov = max_order_;
+    return;
+  }
+
+  PathTrie* history;
+  lm::WordIndex word_index;
+  if (is_character_based_ ||
+      tokenization_char_map_.find(prefix->character) != tokenization_char_map_.end()) {
+    // the token is the last character, read after the parent's tokens
+    history = prefix->parent;
+    word_index = label_word_index_[prefix->character];
+  } else if (prefix->has_dictionary()) {
+    // the token is the word since the last tokenization symbol, which the
+    // dictionary state of the prefix identifies
+    history = prefix->parent;
+    while (!history->is_empty() &&
+           tokenization_char_map_.find(history->character) == tokenization_char_map_.end()) {
+      history = history->parent;
+    }
+    word_index = get_dictionary_word_index(prefix->dictionary_state());
+  } else {
+    std::vector<int> word;
+    std::vector<int> timesteps;
+    history = prefix->get_path_vec(word, timesteps, tokenization_char_map_);
+    word_index = model->BaseVocabulary().Index(vec2str(word));
+  }
+  if (!history->lm_scored) {
+    score_prefix(history, stats);
+  }
+
+  double cond_prob = base_score(history->lm_state, word_index, &prefix->lm_state, stats);
+  // any out of vocabulary token within the n-gram window gives OOV_SCORE
+  bool oov = word_index == 0 ||
+             history->lm_tokens_since_oov + 1 < static_cast<int>(max_order_);
+  prefix->lm_log_cond_prob = oov ? OOV_SCORE : cond_prob / NUM_FLT_LOGE;
+  prefix->lm_tokens_since_oov =
+      word_index == 0 ? 0 : std::min(history->lm_tokens_since_oov + 1, static_cast<int>(max_order_));
+}
+
+float Scorer::base_score(const lm::ngram::State& state,
+                         lm::WordIndex word,
+                         lm::ngram::State* out_state,
+                         DecoderStats* stats) {
+  float score;
+  if (cache_ != nullptr && cache_->find(state, word, &score, out_state)) {
+    if (stats != nullptr) {
+      ++stats->num_lm_cache_hits;
+    }
+    return score;
+  }
+  if (stats != nullptr) {
+    ++stats->num_lm_queries;
+  }
+  lm::base::Model* model = static_cast<lm::base::Model*>(language_model_);
+  score = model->BaseScore(&state, word, out_state);
+  if (cache_ != nullptr) {
+    cache_->insert(state, word, score, *out_state);
+  }
+  return score;
+}
+
 double Scorer::get_sent_log_prob(const std::vector<std::string>& words) {
   std::vector<std::string> sentence;
   if (words.size() == 0) {
@@ -131,6 +249,14 @@ void Scorer::reset_params(float alpha, float beta) {
   this->beta = beta;
 }
 
+void Scorer::set_cache_capacity(size_t capacity) {
+  if (capacity == 0) {
+    cache_.reset();
+  } else {
+    cache_.reset(new LMScoreCache(capacity));
+  }
+}
+
 std::string Scorer::vec2str(const std::vector<int>& input) {
   // todo: might need to write logic to input space before and after a stop_symbol token eg: " u0020 "
   std::string word;
@@ -149,12 +275,15 @@ std::string Scorer::vec2str(const std::vector<int>& input) {
 std::vector<std::string> Scorer::split_labels(const std::vector<int>& labels) {
   if (labels.empty()) return {};
   
+  std::vector<std::string> words;
   if (is_character_based_) {
-    std::cerr<<"splitting char model not defined."<<std::endl;
-    std::exit(1);
+    // each character is a token of the lm
+    for (auto label : labels) {
+      words.push_back(char_list_[label]);
+    }
+    return words;
   }
-  
-  std::vector<std::string> words;
+
   std::string current_string;
   bool start_of_new_word = true;
   for(auto label: labels){
@@ -248,38 +377,143 @@ std::vector<std::string> Scorer::make_ngram(PathTrie* prefix) {
   return ngram;
 }
 
+lm::WordIndex Scorer::get_dictionary_word_index(int state) const {
+  if (state < 0 || static_cast<size_t>(state) >= dictionary_word_index_.size()) {
+    return 0;
+  }
+  return dictionary_word_index_[state];
+}
+
 void Scorer::fill_dictionary() {
-  fst::StdVectorFst dictionary;
+  // Convert each unigram to ints
+  std::vector<std::vector<int>> words;
+  for (const auto& word : vocabulary_) {
+    std::vector<int> int_word;
+    if (word_to_labels(word, char_map_, &int_word) && !int_word.empty()) {
+      words.push_back(int_word);
+    }
+  }
 
-  // For each unigram convert to ints and put in trie
-  int dict_size = 0;
+  dict_size_ = words.size();
+
+  /* Put them in a trie, built deterministic with its arcs sorted: it is
+   * assumed our dictionary is deterministic when using it (lest we'd have
+   * to check for multiple transitions at each state).
+   *
+   * The FST is deliberately not minimized: minimization would merge the
+   * final states of different words, while each word needs its own final
+   * state to map it to its lm word index below.
+   */
+  fst::StdVectorFst trie;
+  std::vector<fst::StdVectorFst::StateId> final_states;
+  build_dictionary_trie(words, &trie, &final_states);
+
+  // Flatten it for the lookups of the decoder
+  dictionary_.reset(new Lexicon(trie, char_list_.size()));
+
+  // Map the final state of each word to the word's lm index, so a prefix's
+  // dictionary state gives its word index without building any string
+  lm::base::Model* model = static_cast<lm::base::Model*>(language_model_);
+  dictionary_word_index_.assign(dictionary_->num_states(), 0);
+  for (size_t i = 0; i < words.size(); ++i) {
+    dictionary_word_index_[final_states[i]] =
+        model->BaseVocabulary().Index(vec2str(words[i]));
+  }
+}
+
+std::string Scorer::dictionary_cache_path(const std::string& dir) const {
+  // 64 bit FNV-1a over everything the dictionary is built from
+  uint64_t hash = 14695981039346656037ULL;
+  auto add = [&hash](const std::string& str) {
+    for (unsigned char c : str) {
+      hash = (hash ^ c) * 1099511628211ULL;
+    }
+    hash = (hash ^ 0xff) * 1099511628211ULL;
+  };
+  add("ctcdecode dictionary v2");
   for (const auto& word : vocabulary_) {
-    bool added = add_word_to_dictionary(word, char_map_, &dictionary);
-    dict_size += added ? 1 : 0;
+    add(word);
+  }
+  add("");
+  for (size_t i = 0; i < char_list_.size(); ++i) {
+    add(char_list_[i]);
+    add(tokenization_char_map_.count(i) ? "1" : "0");
   }
 
-  dict_size_ = dict_size;
+  char name[64];
+  snprintf(name, sizeof(name), "dictionary-%016llx", (unsigned long long)hash);
+  return dir + "/" + name;
+}
 
-  /* Simplify FST
+// header of the word index file, followed by the number of states and the
+// lm word index of each state
+static const char DICTIONARY_INDEX_MAGIC[8] = {'C', 'T', 'C', 'D', 'I', 'D', 'X', '1'};
 
-   * This gets rid of "epsilon" transitions in the FST.
-   * These are transitions that don't require a string input to be taken.
-   * Getting rid of them is necessary to make the FST determinisitc, but
-   * can greatly increase the size of the FST
-   */
-  fst::RmEpsilon(&dictionary);
-  fst::StdVectorFst* new_dict = new fst::StdVectorFst;
+bool Scorer::load_dictionary(const std::string& path) {
+  std::ifstream index_strm(path + ".idx", std::ios_base::in | std::ios_base::binary);
+  if (!index_strm) {
+    return false;
+  }
 
-  /* This makes the FST deterministic, meaning for any string input there's
-   * only one possible state the FST could be in.  It is assumed our
-   * dictionary is deterministic when using it.
-   * (lest we'd have to check for multiple transitions at each state)
-   */
-  fst::Determinize(dictionary, new_dict);
+  char magic[sizeof(DICTIONARY_INDEX_MAGIC)];
+  uint64_t dict_size = 0, num_states = 0;
+  index_strm.read(magic, sizeof(magic));
+  index_strm.read(reinterpret_cast<char*>(&dict_size), sizeof(dict_size));
+  index_strm.read(reinterpret_cast<char*>(&num_states), sizeof(num_states));
+  if (!index_strm ||
+      !std::equal(magic, magic + sizeof(magic), DICTIONARY_INDEX_MAGIC)) {
+    return false;
+  }
 
-  /* Finds the simplest equivalent fst. This is unnecessary but decreases
-   * memory usage of the dictionary
-   */
-  fst::Minimize(new_dict);
-  this->dictionary = new_dict;
+  // map the lexicon in place rather than reading it, it is checked before
+  // trusting the state count of the index
+  std::unique_ptr<Lexicon> new_dict(Lexicon::map(path + ".lex"));
+  if (new_dict == nullptr || new_dict->num_states() != num_states ||
+      new_dict->num_labels() != char_list_.size()) {
+    return false;
+  }
+
+  std::vector<lm::WordIndex> word_index(num_states);
+  index_strm.read(reinterpret_cast<char*>(word_index.data()),
+                  num_states * sizeof(lm::WordIndex));
+  if (!index_strm) {
+    return false;
+  }
+
+  dictionary_.swap(new_dict);
+  dict_size_ = dict_size;
+  dictionary_word_index_.swap(word_index);
+  return true;
+}
+
+void Scorer::save_dictionary(const std::string& path) const {
+  // write to temporary files renamed into place, the index first, so that
+  // concurrent scorers never see a partial cache
+  std::ostringstream suffix;
+  suffix << ".tmp" << getpid();
+
+  std::string index_path = path + ".idx";
+  {
+    std::ofstream strm(index_path + suffix.str(), std::ios_base::out | std::ios_base::binary);
+    uint64_t dict_size = dict_size_, num_states = dictionary_word_index_.size();
+    strm.write(DICTIONARY_INDEX_MAGIC, sizeof(DICTIONARY_INDEX_MAGIC));
+    strm.write(reinterpret_cast<const char*>(&dict_size), sizeof(dict_size));
+    strm.write(reinterpret_cast<const char*>(&num_states), sizeof(num_states));
+    strm.write(reinterpret_cast<const char*>(dictionary_word_index_.data()),
+               num_states * sizeof(lm::WordIndex));
+    if (!strm) {
+      std::cerr << "failed to write the dictionary cache " << index_path << std::endl;
+      std::remove((index_path + suffix.str()).c_str());
+      return;
+    }
+  }
+  std::rename((index_path + suffix.str()).c_str(), index_path.c_str());
+
+  std::string lexicon_path = path + ".lex";
+  if (!dictionary_->write(lexicon_path + suffix.str())) {
+    std::cerr << "failed to write the dictionary cache " << lexicon_path << std::endl;
+    std::remove((lexicon_path + suffix.str()).c_str());
+    return;
+  }
+  std::rename((lexicon_path + suffix.str()).c_str(), lexicon_path.c_str());
 }
@@ -10,8 +10,12 @@
 #include "lm/enumerate_vocab.hh"
 #include "lm/virtual_interface.hh"
 #include "lm/word_index.hh"
+#include "util/mmap.hh"
 #include "util/string_piece.hh"
 
+#include "decoder_stats.h"
+#include "lexicon.h"
+#include "lm_cache.h"
 #include "path_trie.h"
 
 const double OOV_SCORE = -1000.0;
@@ -34,6 +38,18 @@ public:
 /* External scorer to query score for n-gram or sentence, including language
  * model scoring and word insertion.
  *
+ * The dictionary of a word based lm is built from every unigram, which
+ * takes long for large vocabularies. If dictionary_cache_dir is given, it is
+ * written there once, keyed by a hash of the lm vocabulary and the labels,
+ * and memory mapped by the following scorers instead of being rebuilt.
+ *
+ * Binary lms are memory mapped shared and read only with the LAZY and
+ * POPULATE_* load methods, so that the processes decoding with the same lm
+ * on one host share one copy of it in the page cache. LAZY, the default,
+ * also starts without reading the whole file; the pages are read on their
+ * first lookup. READ and PARALLEL_READ copy the model into private memory,
+ * as does any load method for ARPA lms.
+ *
  * Example:
  *     Scorer scorer(alpha, beta, "path_of_language_model");
  *     scorer.get_log_cond_prob({ "WORD1", "WORD2", "WORD3" });
@@ -45,12 +61,23 @@ public:
          double beta,
          const std::string &lm_path,
          const std::vector<std::string> &vocabulary,
-         const std::vector<std::string> &tokenization_vocabulary);
-         
+         const std::vector<std::string> &tokenization_vocabulary,
+         const std::string &dictionary_cache_dir = "",
+         util::LoadMethod load_method = util::LAZY);
+
   ~Scorer();
 
   double get_log_cond_prob(const std::vector<std::string> &words);
 
+  /* Log conditional probability of the last token of a prefix given its
+   * history: the tokenization symbol of a symbol node, the word read so far
+   * for any other node (each character for a character based lm). The lm
+   * state is cached on the node, so scoring a new token costs one lookup
+   * from the state of the node holding its history. The lm lookups are
+   * counted in stats, if not null.
+   */
+  double get_log_cond_prob(PathTrie *prefix, DecoderStats *stats = nullptr);
+
   double get_sent_log_prob(const std::vector<std::string> &words);
 
   // return the max order
@@ -65,6 +92,17 @@ public:
   // reset params alpha & beta
   void reset_params(float alpha, float beta);
 
+  // share a cache of at most capacity lm scores between all the decoding
+  // threads, 0 disables it. Not to be called while decoding.
+  void set_cache_capacity(size_t capacity);
+
+  // return the lm score cache, nullptr if disabled
+  const LMScoreCache *get_cache() const { return cache_.get(); }
+
+  // return the dictionary of a word based lm, nullptr for a character based
+  // one. It is read concurrently by every decoding thread.
+  const Lexicon *get_dictionary() const { return dictionary_.get(); }
+
   // make ngram for a given prefix
   std::vector<std::string> make_ngram(PathTrie *prefix);
 
@@ -80,21 +118,32 @@ public:
   std::vector<std::string> char_list_;
   // stop symbols defined for tokenization logic
   std::unordered_map<int, std::string> tokenization_char_map_;
-  // pointer to the dictionary of FST
-  void *dictionary;
 
 protected:
   // necessary setup: load language model, set char map, fill FST's dictionary
   void setup(const std::string &lm_path,
              const std::vector<std::string> &char_list,
-             const std::vector<std::string> &tokenization_char_list);
+             const std::vector<std::string> &tokenization_char_list,
+             const std::string &dictionary_cache_dir,
+             util::LoadMethod load_method);
 
   // load language model from given path
-  void load_lm(const std::string &lm_path);
+  void load_lm(const std::string &lm_path, util::LoadMethod load_method);
 
   // fill dictionary for FST
   void fill_dictionary();
 
+  // path prefix of the cached dictionary in dir, unique to the lm vocabulary
+  // and the labels
+  std::string dictionary_cache_path(const std::string &dir) const;
+
+  // load the dictionary and its word indices from the cache files at path,
+  // return false if they don't exist or are unreadable
+  bool load_dictionary(const std::string &path);
+
+  // write the dictionary and its word indices to the cache files at path
+  void save_dictionary(const std::string &path) const;
+
   // set char map
   void set_char_map(const std::vector<std::string> &char_list);
 
@@ -107,6 +156,19 @@ protected:
   // translate the vector in index to string
   std::string vec2str(const std::vector<int> &input);
 
+  // fill the lm cache of a prefix, see get_log_cond_prob(PathTrie *)
+  void score_prefix(PathTrie *prefix, DecoderStats *stats);
+
+  // lm::base::Model::BaseScore through the score cache, if any
+  float base_score(const lm::ngram::State &state,
+                   lm::WordIndex word,
+                   lm::ngram::State *out_state,
+                   DecoderStats *stats = nullptr);
+
+  // lm word index of the word accepted in a dictionary state, 0 (the index
+  // of <unk>) if the state is not final
+  lm::WordIndex get_dictionary_word_index(int state) const;
+
 private:
   void *language_model_;
   bool is_character_based_;
@@ -116,6 +178,13 @@ private:
 
   std::unordered_map<std::string, int> char_map_;
   std::vector<std::string> vocabulary_;
+  // lm word index of each label, used for tokenization symbols and by
+  // character based lms
+  std::vector<lm::WordIndex> label_word_index_;
+  std::unique_ptr<Lexicon> dictionary_;
+  // lm word index of the word accepted in each dictionary state
+  std::vector<lm::WordIndex> dictionary_word_index_;
+  std::unique_ptr<LMScoreCache> cache_;
 };
 
 #endif  // SCORER_H_
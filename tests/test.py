@@ -3,11 +3,20 @@ from __future__ import absolute_import
 from __future__ import division
 from __future__ import print_function
 
+import glob
+import os
+import shutil
+import struct
+import tempfile
+import unicodedata
 import unittest
 import ctcdecode
 import torch
 
 
+TEST_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
 class TestDecoders(unittest.TestCase):
     def setUp(self):
         self.vocab_list = ['\'', ' ', 'a', 'b', 'c', 'd', '_']
@@ -56,6 +65,37 @@ class TestDecoders(unittest.TestCase):
     def convert_to_string(self, tokens, vocab, seq_len):
         return ''.join([vocab[x] for x in tokens[0:seq_len]])
 
+    def twinkle_labels(self):
+        # the uxxxx labels of twinkle.txt, as in decode_with_lm.py, and the
+        # non letter ones that separate the words
+        labels = set()
+        separators = set()
+        with open(os.path.join(TEST_DIR, 'twinkle.txt'), 'r') as fh:
+            for line in fh:
+                for word in line.strip().split():
+                    for label in word.split('_'):
+                        labels.add(label)
+                        if 'L' not in unicodedata.category(chr(int(label[1:], 16))):
+                            separators.add(label)
+        return ['<ctc-blank>'] + sorted(labels), sorted(separators)
+
+    def twinkle_probs(self, text, labels):
+        # 0.7 on the label of each character, a blank between repeated ones
+        other = (1 - 0.7) / (len(labels) - 1)
+        probs_seq = []
+        prev_char = None
+        for char in text:
+            if char == prev_char:
+                probs_seq.append([other] * len(labels))
+                probs_seq[-1][0] = 0.7
+            probs_seq.append([other] * len(labels))
+            probs_seq[-1][labels.index('u%04x' % ord(char))] = 0.7
+            prev_char = char
+        return torch.FloatTensor([probs_seq])
+
+    def twinkle_string(self, tokens, labels, seq_len):
+        return ''.join([chr(int(labels[x][1:], 16)) for x in tokens[0:seq_len]])
+
     def test_beam_search_decoder_1(self):
         probs_seq = torch.FloatTensor([self.probs_seq1])
         decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
@@ -72,6 +112,21 @@ class TestDecoders(unittest.TestCase):
         output_str = self.convert_to_string(beam_result[0][0], self.vocab_list, out_seq_len[0][0])
         self.assertEqual(output_str, self.beam_search_result[1])
 
+    def test_beam_search_decoder_cutoff_top_n(self):
+        # cutoff_top_n only bounds the cumulative probability cutoff, with the default cutoff_prob of 1.0 every
+        # label is still expanded
+        probs_seq = torch.FloatTensor([self.probs_seq1])
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'))
+        expected = decoder.decode(probs_seq)
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size, cutoff_top_n=1,
+                                           blank_id=self.vocab_list.index('_'))
+        beam_result, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+        output_str = self.convert_to_string(beam_result[0][0], self.vocab_list, out_seq_len[0][0])
+        self.assertEqual(output_str, self.beam_search_result[0])
+        for tensor, expected_tensor in zip((beam_result, beam_scores, timesteps, out_seq_len), expected):
+            self.assertTrue(torch.equal(tensor, expected_tensor))
+
     def test_beam_search_decoder_batch(self):
         probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
         decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
@@ -82,6 +137,335 @@ class TestDecoders(unittest.TestCase):
         self.assertEqual(output_str1, self.beam_search_result[0])
         self.assertEqual(output_str2, self.beam_search_result[1])
 
+    def test_beam_search_decoder_log_probs(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2]).log()
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'), log_probs_input=True)
+        beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+        output_str1 = self.convert_to_string(beam_results[0][0], self.vocab_list, out_seq_len[0][0])
+        output_str2 = self.convert_to_string(beam_results[1][0], self.vocab_list, out_seq_len[1][0])
+        self.assertEqual(output_str1, self.beam_search_result[0])
+        self.assertEqual(output_str2, self.beam_search_result[1])
+
+    def test_beam_search_decoder_blank_skip(self):
+        blank_frame = [0.001] * 6 + [0.994]
+        probs_seq = torch.FloatTensor([[blank_frame] * 3 + self.probs_seq1 + [blank_frame] * 3])
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'), blank_skip_threshold=0.99)
+        beam_result, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+        output_str = self.convert_to_string(beam_result[0][0], self.vocab_list, out_seq_len[0][0])
+        self.assertEqual(output_str, self.beam_search_result[0])
+        # skipped frames still count in the timesteps
+        self.assertTrue(all(t >= 3 for t in timesteps[0][0][:out_seq_len[0][0]]))
+
+    def test_beam_search_decoder_parallel_expansion(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'), num_expansion_threads=2)
+        beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+        output_str1 = self.convert_to_string(beam_results[0][0], self.vocab_list, out_seq_len[0][0])
+        output_str2 = self.convert_to_string(beam_results[1][0], self.vocab_list, out_seq_len[1][0])
+        self.assertEqual(output_str1, self.beam_search_result[0])
+        self.assertEqual(output_str2, self.beam_search_result[1])
+
+    def test_beam_search_decoder_parallel_expansion_lm(self):
+        # the lm scoring is the part of the expansion split over the threads
+        labels, separators = self.twinkle_labels()
+        probs_seq = self.twinkle_probs('twinkle, twinkle, little star,', labels)
+
+        def decode(num_expansion_threads):
+            decoder = ctcdecode.CTCBeamDecoder(labels, alpha=2.0, beta=0.4, cutoff_top_n=len(labels),
+                                               tokenization_labels=separators,
+                                               model_path=os.path.join(TEST_DIR, 'twinkle.ngram'),
+                                               beam_width=100, blank_id=0,
+                                               num_expansion_threads=num_expansion_threads)
+            return decoder.decode(probs_seq, return_stats=True)
+
+        expected = decode(0)
+        result = decode(3)
+        for tensor, expected_tensor in zip(result[:4], expected[:4]):
+            self.assertTrue(torch.equal(tensor, expected_tensor))
+        # the same work is counted, only the times differ
+        for field in ctcdecode.DECODER_STATS_FIELDS:
+            if not field.endswith('_ms'):
+                self.assertEqual(result[4][0][field], expected[4][0][field])
+        self.assertGreater(result[4][0]['num_lm_requests'], 0)
+
+    def test_beam_search_decoder_stats(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'))
+        beam_results, beam_scores, timesteps, out_seq_len, stats = decoder.decode(probs_seq, return_stats=True)
+        output_str1 = self.convert_to_string(beam_results[0][0], self.vocab_list, out_seq_len[0][0])
+        self.assertEqual(output_str1, self.beam_search_result[0])
+        self.assertEqual(len(stats), 2)
+        for sample_stats in stats:
+            self.assertEqual(set(sample_stats), set(ctcdecode.DECODER_STATS_FIELDS))
+            self.assertEqual(sample_stats['num_frames'], len(self.probs_seq1))
+            self.assertGreater(sample_stats['num_candidates'], 0)
+            self.assertGreater(sample_stats['peak_live_nodes'], 0)
+            # no lm, no dictionary
+            self.assertEqual(sample_stats['num_lm_requests'], 0)
+            self.assertEqual(sample_stats['num_dictionary_rejections'], 0)
+
+    def test_beam_search_decoder_ragged(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'))
+        beam_results, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+        tokens, ragged_timesteps, offsets, scores = decoder.decode_ragged(probs_seq, num_results=2)
+        self.assertEqual(offsets.size(0), 2 * 2 + 1)
+        self.assertEqual(tokens.size(0), offsets[-1])
+        for b in range(2):
+            for p in range(2):
+                begin, end = offsets[b * 2 + p], offsets[b * 2 + p + 1]
+                self.assertEqual(end - begin, out_seq_len[b][p])
+                self.assertEqual(tokens[begin:end].tolist(), beam_results[b][p][:out_seq_len[b][p]].tolist())
+                self.assertEqual(ragged_timesteps[begin:end].tolist(), timesteps[b][p][:out_seq_len[b][p]].tolist())
+                self.assertEqual(scores[b][p], beam_scores[b][p])
+        output_str = self.convert_to_string(tokens[offsets[2]:offsets[3]], self.vocab_list, offsets[3] - offsets[2])
+        self.assertEqual(output_str, self.beam_search_result[1])
+
+    def test_beam_search_decoder_beam_threshold(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'), beam_threshold=1.0)
+        tokens, timesteps, offsets, scores = decoder.decode_ragged(probs_seq, num_results=self.beam_size)
+        for b in range(2):
+            begin, end = offsets[b * self.beam_size], offsets[b * self.beam_size + 1]
+            output_str = self.convert_to_string(tokens[begin:end], self.vocab_list, end - begin)
+            self.assertEqual(output_str, self.beam_search_result[b])
+        # the prefixes far below the best one are dropped before the beam fills up
+        self.assertLess(sum(1 for score in scores[1] if score != float('inf')), self.beam_size)
+
+    def test_beam_search_decoder_adaptive_beam(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'), min_beam_width=4, min_cutoff_top_n=3)
+        beam_results, beam_scores, timesteps, out_seq_len, stats = decoder.decode(probs_seq, return_stats=True)
+        output_str1 = self.convert_to_string(beam_results[0][0], self.vocab_list, out_seq_len[0][0])
+        output_str2 = self.convert_to_string(beam_results[1][0], self.vocab_list, out_seq_len[1][0])
+        self.assertEqual(output_str1, self.beam_search_result[0])
+        self.assertEqual(output_str2, self.beam_search_result[1])
+        # confident frames expand fewer candidates than the fixed cutoff_top_n
+        full_decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                                blank_id=self.vocab_list.index('_'))
+        full_stats = full_decoder.decode(probs_seq, return_stats=True)[-1]
+        self.assertLess(sum(s['num_candidates'] for s in stats), sum(s['num_candidates'] for s in full_stats))
+        top_n_decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                                 blank_id=self.vocab_list.index('_'), min_cutoff_top_n=3)
+        top_n_stats = top_n_decoder.decode(probs_seq, return_stats=True)[-1]
+        self.assertLess(sum(s['num_candidates'] for s in top_n_stats), sum(s['num_candidates'] for s in full_stats))
+        # with the default cutoff_prob, uniform frames expand every label as without the adaptive beam, even
+        # beyond cutoff_top_n
+        uniform_probs = torch.FloatTensor([[[1.0 / len(self.vocab_list)] * len(self.vocab_list)] * 4])
+        uniform_stats = []
+        for min_cutoff_top_n in (0, 1):
+            decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size, cutoff_top_n=2,
+                                               blank_id=self.vocab_list.index('_'), min_cutoff_top_n=min_cutoff_top_n)
+            uniform_stats.append(decoder.decode(uniform_probs, return_stats=True)[-1][0]['num_candidates'])
+        self.assertEqual(uniform_stats[1], uniform_stats[0])
+        with self.assertRaises(ValueError):
+            ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=4, min_beam_width=8)
+
+    def test_beam_search_decoder_deadline(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'))
+        # a generous budget doesn't change the results
+        beam_results, beam_scores, timesteps, out_seq_len, degraded = decoder.decode(probs_seq, time_budget_ms=1e6)
+        output_str1 = self.convert_to_string(beam_results[0][0], self.vocab_list, out_seq_len[0][0])
+        output_str2 = self.convert_to_string(beam_results[1][0], self.vocab_list, out_seq_len[1][0])
+        self.assertEqual(output_str1, self.beam_search_result[0])
+        self.assertEqual(output_str2, self.beam_search_result[1])
+        self.assertEqual(degraded, [False, False])
+        # an exhausted budget falls back to the best path
+        tokens, timesteps, offsets, scores, stats, degraded = decoder.decode_ragged(
+            probs_seq, return_stats=True, utterance_time_budget_ms=1e-6)
+        self.assertEqual(degraded, [True, True])
+        for b in range(2):
+            self.assertGreater(stats[b]['num_degraded_frames'], 0)
+            self.assertEqual(sum(1 for score in scores[b] if score != float('inf')), 1)
+
+    def test_beam_search_decoder_word_lm(self):
+        labels, separators = self.twinkle_labels()
+        probs_seq = self.twinkle_probs('twinkle, twinkle, little star,', labels)
+        decoder = ctcdecode.CTCBeamDecoder(labels, alpha=2.0, beta=0.4, cutoff_top_n=len(labels),
+                                           tokenization_labels=separators,
+                                           model_path=os.path.join(TEST_DIR, 'twinkle.ngram'),
+                                           beam_width=100, blank_id=0)
+        beam_result, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+        output_str1 = self.twinkle_string(beam_result[0][0], labels, out_seq_len[0][0])
+        output_str2 = self.twinkle_string(beam_result[0][1], labels, out_seq_len[0][1])
+        self.assertEqual(output_str1, 'Twinkle, twinkle, little star,')
+        self.assertEqual(output_str2, 'twinkle, twinkle, little star,')
+        self.assertAlmostEqual(beam_scores[0][0], 16.946779, places=3)
+        self.assertAlmostEqual(beam_scores[0][1], 18.520088, places=3)
+
+    def test_beam_search_decoder_char_lm(self):
+        labels, separators = self.twinkle_labels()
+        probs_seq = self.twinkle_probs('twinkle, twinkle, little star,', labels)
+        decoder = ctcdecode.CTCBeamDecoder(labels, alpha=1.0, beta=0.5, cutoff_top_n=len(labels),
+                                           tokenization_labels=separators,
+                                           model_path=os.path.join(TEST_DIR, 'twinkle_chars.ngram'),
+                                           beam_width=100, blank_id=0)
+        beam_result, beam_scores, timesteps, out_seq_len = decoder.decode(probs_seq)
+        output_str1 = self.twinkle_string(beam_result[0][0], labels, out_seq_len[0][0])
+        output_str2 = self.twinkle_string(beam_result[0][1], labels, out_seq_len[0][1])
+        self.assertEqual(output_str1, 'twinkle, twinkle, little star,')
+        self.assertEqual(output_str2, 'twinkle, twinkle, litle star,')
+        self.assertAlmostEqual(beam_scores[0][0], 53.140549, places=3)
+        self.assertAlmostEqual(beam_scores[0][1], 53.587357, places=3)
+
+    def test_beam_search_decoder_lm_cache(self):
+        labels, separators = self.twinkle_labels()
+        probs_seq = self.twinkle_probs('twinkle, twinkle, little star,', labels)
+
+        def make_decoder(lm_cache_size):
+            return ctcdecode.CTCBeamDecoder(labels, alpha=2.0, beta=0.4, cutoff_top_n=len(labels),
+                                            tokenization_labels=separators,
+                                            model_path=os.path.join(TEST_DIR, 'twinkle.ngram'),
+                                            beam_width=100, blank_id=0, lm_cache_size=lm_cache_size)
+
+        expected = make_decoder(0).decode(probs_seq)
+        decoder = make_decoder(1000)
+        for _ in range(2):
+            for tensor, expected_tensor in zip(decoder.decode(probs_seq), expected):
+                self.assertTrue(torch.equal(tensor, expected_tensor))
+        self.assertGreater(decoder.lm_cache_stats()['hits'], 0)
+
+    def test_beam_search_decoder_lm_load_method(self):
+        labels, separators = self.twinkle_labels()
+        probs_seq = self.twinkle_probs('twinkle, twinkle, little star,', labels)
+
+        def make_decoder(lm_load_method):
+            return ctcdecode.CTCBeamDecoder(labels, alpha=2.0, beta=0.4, cutoff_top_n=len(labels),
+                                            tokenization_labels=separators,
+                                            model_path=os.path.join(TEST_DIR, 'twinkle.ngram'),
+                                            beam_width=100, blank_id=0, lm_load_method=lm_load_method)
+
+        expected = make_decoder('lazy').decode(probs_seq)
+        for tensor, expected_tensor in zip(make_decoder('read').decode(probs_seq), expected):
+            self.assertTrue(torch.equal(tensor, expected_tensor))
+        with self.assertRaises(ValueError):
+            make_decoder('mmap')
+
+    def test_beam_search_decoder_dictionary_cache(self):
+        labels, separators = self.twinkle_labels()
+        probs_seq = self.twinkle_probs('twinkle, twinkle, little star,', labels)
+        cache_dir = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, cache_dir)
+
+        def decode(dictionary_cache_dir):
+            decoder = ctcdecode.CTCBeamDecoder(labels, alpha=2.0, beta=0.4, cutoff_top_n=len(labels),
+                                               tokenization_labels=separators,
+                                               model_path=os.path.join(TEST_DIR, 'twinkle.ngram'),
+                                               beam_width=100, blank_id=0,
+                                               dictionary_cache_dir=dictionary_cache_dir)
+            return decoder.decode(probs_seq)
+
+        def assert_same_result(result):
+            for tensor, expected_tensor in zip(result, expected):
+                self.assertTrue(torch.equal(tensor, expected_tensor))
+
+        def cache_files():
+            return sorted(glob.glob(os.path.join(cache_dir, 'dictionary-*')))
+
+        expected = decode(None)
+        # the first scorer builds the dictionary and writes it, the next one maps it
+        assert_same_result(decode(cache_dir))
+        files = cache_files()
+        self.assertEqual([os.path.splitext(f)[1] for f in files], ['.idx', '.lex'])
+        index_path, lexicon_path = files
+        written = [os.stat(f) for f in files]
+        assert_same_result(decode(cache_dir))
+        self.assertEqual([os.stat(f).st_ino for f in files], [st.st_ino for st in written])
+
+        # a corrupt cache is rebuilt
+        with open(lexicon_path, 'r+b') as fh:
+            fh.truncate(written[1].st_size // 2)
+        assert_same_result(decode(cache_dir))
+        self.assertEqual(os.path.getsize(lexicon_path), written[1].st_size)
+        with open(index_path, 'wb') as fh:
+            fh.write(b'\0' * written[0].st_size)
+        assert_same_result(decode(cache_dir))
+        with open(index_path, 'rb') as fh:
+            self.assertEqual(fh.read(8), b'CTCDIDX1')
+
+        # so is a lexicon of other labels
+        other_dir = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, other_dir)
+        ctcdecode.CTCBeamDecoder(labels[:-1], alpha=2.0, beta=0.4, tokenization_labels=separators,
+                                 model_path=os.path.join(TEST_DIR, 'twinkle.ngram'), blank_id=0,
+                                 dictionary_cache_dir=other_dir)
+        shutil.copyfile(glob.glob(os.path.join(other_dir, 'dictionary-*.lex'))[0], lexicon_path)
+        self.assertNotEqual(os.path.getsize(lexicon_path), written[1].st_size)
+        assert_same_result(decode(cache_dir))
+        self.assertEqual(os.path.getsize(lexicon_path), written[1].st_size)
+
+    def test_beam_search_decoder_dictionary_round_trip(self):
+        labels, separators = self.twinkle_labels()
+        with open(os.path.join(TEST_DIR, 'twinkle.txt'), 'r') as fh:
+            texts = [''.join([chr(int(label[1:], 16)) for word in line.split() for label in word.split('_')])
+                     for line in fh]
+        cache_dir = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, cache_dir)
+
+        def decode_texts(dictionary_cache_dir):
+            decoder = ctcdecode.CTCBeamDecoder(labels, alpha=2.0, beta=0.4, cutoff_top_n=len(labels),
+                                               tokenization_labels=separators,
+                                               model_path=os.path.join(TEST_DIR, 'twinkle.ngram'),
+                                               beam_width=20, blank_id=0,
+                                               dictionary_cache_dir=dictionary_cache_dir)
+            results = []
+            for text in texts:
+                beam_result, beam_scores, timesteps, out_seq_len = decoder.decode(self.twinkle_probs(text, labels))
+                results.append((self.twinkle_string(beam_result[0][0], labels, out_seq_len[0][0]),
+                                float(beam_scores[0][0])))
+            return results
+
+        # every word of the lm goes through the written and mapped lexicon
+        built = decode_texts(cache_dir)
+        lexicon_path = glob.glob(os.path.join(cache_dir, 'dictionary-*.lex'))[0]
+        with open(lexicon_path, 'rb') as fh:
+            lexicon = fh.read()
+        self.assertEqual(decode_texts(cache_dir), built)
+        self.assertEqual([text for text, score in built], texts)
+
+        # a lexicon whose arcs are out of order is rebuilt
+        num_states = struct.unpack_from('<I', lexicon, 8)[0]
+        arc_begin = struct.unpack_from('<%dI' % (num_states + 1), lexicon, 32)
+        arc_label = 32 + (num_states + 1) * 4
+        state = [s for s in range(num_states) if arc_begin[s + 1] - arc_begin[s] >= 2][-1]
+        unsorted = bytearray(lexicon)
+        offset = arc_label + arc_begin[state] * 4
+        unsorted[offset:offset + 8] = lexicon[offset + 4:offset + 8] + lexicon[offset:offset + 4]
+        with open(lexicon_path, 'wb') as fh:
+            fh.write(unsorted)
+        self.assertEqual(decode_texts(cache_dir), built)
+        with open(lexicon_path, 'rb') as fh:
+            self.assertEqual(fh.read(), lexicon)
+
+    def test_greedy_decoder(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1, self.probs_seq2])
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'))
+        tokens, timesteps, offsets, scores = decoder.decode_greedy(probs_seq)
+        output_str1 = self.convert_to_string(tokens[offsets[0]:offsets[1]], self.vocab_list, offsets[1] - offsets[0])
+        output_str2 = self.convert_to_string(tokens[offsets[1]:offsets[2]], self.vocab_list, offsets[2] - offsets[1])
+        self.assertEqual(output_str1, self.greedy_result[0])
+        self.assertEqual(output_str2, self.greedy_result[1])
+
+    def test_online_beam_search_decoder(self):
+        probs_seq = torch.FloatTensor([self.probs_seq1])
+        decoder = ctcdecode.CTCBeamDecoder(self.vocab_list, beam_width=self.beam_size,
+                                           blank_id=self.vocab_list.index('_'))
+        state = ctcdecode.DecoderState(decoder)
+        decoder.decode_online(probs_seq[:, :3], [state], [False])
+        beam_result, beam_scores, timesteps, out_seq_len = decoder.decode_online(probs_seq[:, 3:], [state], [True])
+        output_str = self.convert_to_string(beam_result[0][0], self.vocab_list, out_seq_len[0][0])
+        self.assertEqual(output_str, self.beam_search_result[0])
+
 
 if __name__ == '__main__':
     unittest.main()